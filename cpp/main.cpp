@@ -1,13 +1,26 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <vector>
 #include <boost/any.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/version.hpp>
+#include "modules.hpp"
 #include "queryplan.hpp"
+#include "queryplan_admission.hpp"
+#include "queryplan_async.hpp"
+#include "queryplan_multithread.hpp"
+#include "queryplan_process.hpp"
+#include "queryplan_replay.hpp"
+#include "queryplan_sink.hpp"
 
 #if !( (BOOST_VERSION / 100000) >= 1 && (BOOST_VERSION / 100 % 1000) >= 50)
 #error "Boost-1.50 or newer is required: https://svn.boost.org/trac/boost/ticket/6785"
@@ -17,84 +30,7 @@ using namespace std;
 using namespace boost;
 using namespace boost::property_tree;
 
-struct Start {
-    void operator()(int& seed) {
-        seed = rand();
-    }
-};
-
-struct Extra {
-    void operator()(int seed, int& result) {
-        result = seed + rand();
-    }
-};
-
-struct Add {
-    void operator()(int a, int b, int& c) {
-        c = a + b;
-    }
-};
-
-struct Output {
-    void operator()(int result) {
-        cout << "\tresult=" << result << endl;
-    }
-};
-
-struct Output2 {
-    void operator()(long long result) {
-        cout << "\tresult=" << result << endl;
-    }
-};
-
-class DoSomething {
-public:
-    DoSomething(const ptree& config) : extra(0) {}
-
-    void operator()(int a, int b, int& c, ostream& out) {
-        c = a + b + extra;
-        out << "a=" << a << " b=" << b << " c=" << c << "\n";
-    }
-
-private:
-    int extra;
-};
-
-QP_MODULE(DoSomethingModule, "DoSomethingModule", DoSomething,
-        ((QP_IN, int, a))
-        ((QP_IN, int, b))
-        ((QP_OUT, int&, c, 0))
-        , (ostream&),
-        const ptree&
-);
-
-QP_MODULE(StartModule, "StartModule", Start,
-        ((QP_OUT, int&, seed, 0))
-        , ()
-);
-
-QP_MODULE(ExtraModule, "ExtraModule", Extra,
-        ((QP_IN, int, seed))
-        ((QP_OUT, int&, result, 0))
-        , ()
-);
-
-QP_MODULE(AddModule, "AddModule", Add,
-        ((QP_IN, int, a))
-        ((QP_IN, int, b))
-        ((QP_OUT, int&, c, 0))
-        , ()
-);
-
-QP_MODULE(OutputModule, "OutputModule", Output,
-        ((QP_IN, int, result))
-        , ()
-);
-
-QP_MODULE(Output2Module, "Output2Module", Output2,
-        ((QP_IN, long long, result))
-        , ()
-);
+QP_DEFINE_MEMORY_HOOKS()
 
 void runModule(queryplan::Module<>& m)
 {
@@ -159,6 +95,57 @@ void testRegisterModule()
     delete m;
 }
 
+void testArena()
+{
+    cout << __func__ << ":\n";
+
+    DescribeModule<> m("describe");
+
+    map<string, int> keys;
+    keys["result"] = 0;
+    keys["text"] = 1;
+
+    m.resolve(keys);
+
+    auto ctx = std::make_shared<queryplan::Context>(2);
+    (*ctx)[0] = 42;
+
+    m(ctx);
+
+    cout << any_cast<queryplan::ArenaString&>((*ctx)[1]) << "\n";
+    cout << "arena bytes=" << ctx->arena().bytesAllocated() << "\n";
+}
+
+void testMoveInput()
+{
+    cout << __func__ << ":\n";
+
+    UpperModule<> m("upper");
+
+    map<string, int> keys;
+    keys["text"] = 0;
+    keys["upper"] = 1;
+
+    set<string> movables;
+    movables.insert("text");
+
+    m.resolve(keys, movables);
+
+    for (bool movable : { false, true }) {
+        auto ctx = std::make_shared<queryplan::Context>(2);
+        ctx->setMovable(movable);
+        (*ctx)[0] = queryplan::ArenaString("zero copy if moved",
+                queryplan::ArenaAllocator<char>(&ctx->arena()));
+
+        m(ctx);
+
+        cout << "movable=" << movable <<
+            " text=\"" << any_cast<queryplan::ArenaString&>((*ctx)[0]) <<
+            "\" upper=\"" << any_cast<queryplan::ArenaString&>((*ctx)[1]) <<
+            "\"\n";
+    }
+}
+
 void loadQueryPlan(const char* filename)
 {
     cout << "load query plan: " << filename << endl;
@@ -172,6 +159,75 @@ void loadQueryPlan(const char* filename)
     qp.writeGraphviz(cout);
 }
 
+void testDeduplicateModules(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+
+    cout << "numOutputs=" << qp.numOutputs() <<
+        " numDeduplicated=" << qp.numDeduplicated() << endl;
+    qp.writeGraphviz(cout);
+
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(pt);
+
+    planner();
+}
+
+void testMergeQueryPlans(const char* filename1, const char* filename2)
+{
+    cout << __func__ << ": load query plans " << filename1 << " " <<
+        filename2 << endl;
+
+    queryplan::QueryPlan<queryplan::Module<>>::Plans plans(2);
+    plans[0].first = "p1";
+    read_json(filename1, plans[0].second);
+    plans[1].first = "p2";
+    read_json(filename2, plans[1].second);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(plans);
+
+    cout << "numOutputs=" << qp.numOutputs() <<
+        " numDeduplicated=" << qp.numDeduplicated() <<
+        " p1/seed=" << qp.outputIndex("p1/seed") <<
+        " p2/seed=" << qp.outputIndex("p2/seed") <<
+        " p1/c=" << qp.outputIndex("p1/c") <<
+        " p2/c=" << qp.outputIndex("p2/c") << endl;
+    qp.writeGraphviz(cout);
+
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+
+    planner();
+}
+
+// Modules marked deterministic in only one plan are shared all the same.
+void testMergeDeterministic(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    queryplan::QueryPlan<queryplan::Module<>>::Plans plans(2);
+    plans[0].first = "p1";
+    read_json(filename, plans[0].second);
+    plans[1] = plans[0];
+    plans[1].first = "p2";
+    for (auto& entry : plans[1].second) {
+        if (entry.second.count("outputs")) {
+            entry.second.put("deterministic", true);
+        }
+    }
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(plans);
+
+    cout << "numDeduplicated=" << qp.numDeduplicated() <<
+        " shared c=" << (qp.outputIndex("p1/c") == qp.outputIndex("p2/c")) <<
+        endl;
+}
+
 void loadBadQueryPlan(const char* filename)
 {
     try {
@@ -182,6 +238,118 @@ void loadBadQueryPlan(const char* filename)
     }
 }
 
+// Whether every SlowInit constructor started before any of them ended.
+bool slowInitOverlapped()
+{
+    std::lock_guard<std::mutex> lock(SlowInit::mutex());
+    auto& spans = SlowInit::spans();
+    if (spans.size() < 2) {
+        return false;
+    }
+
+    auto last_start = spans[0].first, first_end = spans[0].second;
+    for (auto& span : spans) {
+        last_start = max(last_start, span.first);
+        first_end = min(first_end, span.second);
+    }
+
+    return last_start < first_end;
+}
+
+void testParallelBuild(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+    SlowInit::spans().clear();
+
+    {
+        queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+        cout << "default constructed=" << SlowInit::spans().size() <<
+            " overlapped=" << slowInitOverlapped() << "\n";
+    }
+
+    SlowInit::spans().clear();
+
+    // four threads even on a single CPU box
+    queryplan::BuildOptions options;
+    options.threads = 4;
+    {
+        queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+        cout << "threads=4 constructed=" << SlowInit::spans().size() <<
+            " overlapped=" << slowInitOverlapped() << "\n";
+    }
+
+    SlowInit::spans().clear();
+
+    {
+        queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+            planner(options, pt);
+        cout << "planner threads=4 overlapped=" << slowInitOverlapped() <<
+            "\n";
+    }
+
+    SlowInit::spans().clear();
+
+    // failures are reported in plan order, however constructors finish
+    read_json("t/qp-broken-constructor.json", pt);
+    try {
+        queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+        assert(! "shouldn't reach here");
+    } catch (queryplan::ModuleConstructionError& e) {
+        cout << "threads=4 failed=" << e.errors().size() << "\n" <<
+            e.what() << "\n";
+    }
+
+    SlowInit::spans().clear();
+
+    // a cycle is reported before any module is constructed
+    read_json("t/qp-slow-init-cycle.json", pt);
+    try {
+        queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+        assert(! "shouldn't reach here");
+    } catch (std::invalid_argument& e) {
+        cout << "cycle constructed=" << SlowInit::spans().size() << "\n";
+    }
+}
+
+void testSharedFunctors(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    ptree small, large;
+    small.put("table_size", 1000);
+    large.put("table_size", 2000);
+
+    typedef queryplan::QueryPlan<queryplan::Module<>, const ptree&> Plan;
+    typedef queryplan::FunctorCache<LookupTable> Cache;
+
+    auto table = [](Plan& qp) -> const LookupTable* {
+        auto& m = dynamic_cast<LookupTableModule<>&>(*qp.dependencies()[0]);
+        return &m.functor();
+    };
+
+    {
+        Plan qp1(pt, small), qp2(pt, small), qp3(pt, large);
+
+        cout << "same config shared=" << (table(qp1) == table(qp2)) <<
+            " other config shared=" << (table(qp1) == table(qp3)) << "\n";
+        cout << "live=" << Cache::size() << " constructions=" <<
+            LookupTable::constructions() << "\n";
+    }
+
+    cout << "unloaded live=" << Cache::size() << "\n";
+
+    string key1, key2;
+    queryplan::ArgumentFingerprint<double>::append(key1, 0.1000001);
+    queryplan::ArgumentFingerprint<double>::append(key2, 0.1000002);
+    cout << "close doubles same key=" << (key1 == key2) << "\n";
+}
+
 void testSingleThreadBlockedQueryPlanner(const char* filename)
 {
     cout << __func__ << ": load query plan " << filename << endl;
@@ -208,6 +376,447 @@ void testSignalBasedSingleThreadBlockedQueryPlanner(const char* filename)
     planner();
 }
 
+void testQueryProfiler(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+    auto profiler = std::make_shared<queryplan::QueryProfiler>(qp, 100);
+
+    queryplan::SignalBasedSingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+    planner.setProfiler(profiler);
+
+    for (int i = 0; i < 3; ++i) {
+        planner();
+    }
+
+    profiler->writeGraphviz(cout);
+    profiler->writeJson(cout);
+}
+
+void testQueryReplayer()
+{
+    cout << __func__ << ":\n";
+
+    stringstream capture;
+    queryplan::QueryRecorder<int, string> recorder(capture);
+
+    int count = 0;
+    auto planner = [&count](int n, const string& s) {
+        ++count;
+        cout << "\tn=" << n << " s=\"" << s << "\"\n";
+    };
+    queryplan::RecordingQueryPlanner<decltype(planner), int, string>
+        recording(planner, recorder);
+
+    recording(1, "one");
+    recording(2, "tab\tand\nnewline");
+
+    queryplan::QueryReplayer<int, string> replayer(capture);
+
+    queryplan::ReplayOptions options;
+    options.rate = queryplan::ReplayOptions::Rate::Maximum;
+    options.threads = 1;
+
+    auto report = replayer.replay(planner, options);
+    cout << "replayed=" << report.queries << " called=" << count << "\n";
+
+    // a plan of modules taking the two int arguments, as "replay -a int,int"
+    stringstream typed;
+    queryplan::QueryRecorder<int, int> typedRecorder(typed);
+    typedRecorder.record(1, 10);
+    typedRecorder.record(3, 20);
+
+    ptree pt;
+    read_json("t/qp-incremental.json", pt);
+    auto& replay = queryplan::getReplayRegistry().find("int,int");
+    report = replay(pt, "single", typed, options);
+    cout << "replayed int,int=" << report.queries << "\n";
+
+    // floating point arguments come back bit for bit
+    stringstream doubles;
+    queryplan::QueryRecorder<double> doubleRecorder(doubles);
+    const double third = 1.0 / 3;
+    doubleRecorder.record(third);
+
+    int same = 0;
+    auto doublePlanner = [&same, third](double d) { same += d == third; };
+    queryplan::QueryReplayer<double> doubleReplayer(doubles);
+    report = doubleReplayer.replay(doublePlanner, options);
+    assert(report.queries == 1 && same == 1);
+    cout << "replayed double=" << report.queries << " same=" << same << "\n";
+}
+
+void testHedgedModule(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+    queryplan::MultiThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp, 4);
+
+    // every other lookup is slow, so each query hedges it once
+    for (int i = 0; i < 2; ++i) {
+        auto statuses = planner();
+        cout << "lookup: " << statuses[1] << "\n";
+    }
+
+    auto hedge = planner.hedgePolicy(1);
+    cout << "hedges launched=" << hedge->launched() <<
+        " won=" << hedge->won() << "\n";
+}
+
+void testAdmissionController(queryplan::AdmissionController::Priority priority)
+{
+    cout << __func__ << ": " <<
+        (priority == queryplan::AdmissionController::Priority::Strict ?
+         "strict" : "weighted") << "\n";
+
+    vector<queryplan::AdmissionClass> classes;
+    classes.push_back(queryplan::AdmissionClass("interactive", 4, 1, 3));
+    classes.push_back(queryplan::AdmissionClass("batch", 2, 1, 1));
+
+    string order;
+    {
+        queryplan::AdmissionController controller(classes, 1, priority);
+        size_t interactive = controller.classIndex("interactive");
+        size_t batch = controller.classIndex("batch");
+
+        // hold the only worker until every request has been submitted
+        promise<void> started, release;
+        auto released = release.get_future().share();
+        controller.submit(batch, [&started, released] {
+            started.set_value();
+            released.wait();
+        });
+        started.get_future().wait();
+
+        for (int i = 0; i < 3; ++i) {
+            string name = "b" + to_string(i);
+            cout << name << ": " << controller.submit(batch, [&order, name] {
+                order += name + " ";
+                if (name == "b1") {
+                    throw runtime_error(name);
+                }
+            }) << "\n";
+        }
+        for (int i = 0; i < 5; ++i) {
+            string name = "i" + to_string(i);
+            cout << name << ": " << controller.submit(interactive,
+                    [&order, name] { order += name + " "; }) << "\n";
+        }
+
+        release.set_value();
+
+        while (controller.stats(batch).completed < 3) {
+            this_thread::yield();
+        }
+        auto stats = controller.stats(batch);
+        cout << "batch accepted=" << stats.accepted << " rejected=" <<
+            stats.rejected << " completed=" << stats.completed <<
+            " failed=" << stats.failed << "\n";
+    }
+
+    cout << "order: " << order << "\n";
+}
+
+template<typename P>
+void dumpModuleStatuses(queryplan::QueryPlan<queryplan::Module<>>& qp,
+                        P& planner)
+{
+    auto& g = qp.dependencies();
+    auto statuses = planner();
+
+    for (size_t i = 0; i < statuses.size(); ++i) {
+        cout << g[i]->id() << ": " << statuses[i] << "\n";
+    }
+}
+
+void testModuleFailure(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+    dumpModuleStatuses(qp, planner);
+
+    queryplan::SignalBasedSingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner2(qp);
+    dumpModuleStatuses(qp, planner2);
+
+    queryplan::MultiThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner3(qp);
+    dumpModuleStatuses(qp, planner3);
+}
+
+void testIncrementalSession(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<int, int>> qp(pt);
+    queryplan::IncrementalSession<queryplan::Module<int, int>> session(qp);
+    auto& g = qp.dependencies();
+
+    int calls[][2] = { {1, 10}, {3, 10}, {3, 20}, {3, 20}, {4, 20} };
+    for (auto& args : calls) {
+        session(args[0], args[1]);
+
+        cout << "(" << args[0] << ", " << args[1] << ") sum=" <<
+            any_cast<int>(session.context()->at(qp.outputIndex("sum"))) <<
+            " evaluated:";
+        for (auto v : session.lastEvaluated()) {
+            cout << " " << g[v]->id();
+        }
+        cout << "\n";
+    }
+}
+
+// Drops the kept context after a call that throws or grows its arena
+// too much, while the caller holds no reference to it.
+void testIncrementalReset(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<int, int>> qp(pt);
+    queryplan::IncrementalSession<queryplan::Module<int, int>> session(qp);
+    int words = qp.outputIndex("words");
+
+    int calls[][2] = { {2, 40}, {-1, 40}, {2, 40}, {3, 40}, {4, 40000},
+        {2, 40} };
+    for (auto& args : calls) {
+        cout << "(" << args[0] << ", " << args[1] << ")";
+        try {
+            session(args[0], args[1]);
+        } catch (std::invalid_argument& e) {
+            cout << " " << e.what() << "\n";
+            continue;
+        }
+
+        if (session.context()) {
+            cout << " words=" << any_cast<const ArenaStrings&>(
+                    session.context()->at(words)).size() << "\n";
+        } else {
+            cout << " context dropped\n";
+        }
+    }
+
+    read_json("t/qp-incremental-bad-argument.json", pt);
+    queryplan::QueryPlan<queryplan::Module<int, int>> bad(pt);
+    try {
+        queryplan::IncrementalSession<queryplan::Module<int, int>> s(bad);
+        assert(! "shouldn't reach here");
+    } catch (std::invalid_argument& e) {
+        cout << e.what() << "\n";
+    }
+}
+
+void testMemoryBudget(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+    auto profiler = std::make_shared<queryplan::QueryProfiler>(qp);
+
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+    planner.setProfiler(profiler);
+    planner();
+
+    auto stats = profiler->stats();
+    auto& g = qp.dependencies();
+    for (size_t v = 0; v < stats.size(); ++v) {
+        cout << g[v]->id() << " allocated at least 4MiB: " <<
+            (stats[v].max_allocated_bytes >= (4 << 20)) << "\n";
+    }
+
+    planner.setMemoryBudget(1 << 20, queryplan::MemoryBudget::Policy::Degrade);
+    dumpModuleStatuses(qp, planner);
+
+    planner.setMemoryBudget(1 << 20, queryplan::MemoryBudget::Policy::Abort);
+    try {
+        planner();
+        assert(! "shouldn't reach here");
+    } catch (std::bad_alloc& e) {
+        cout << e.what() << "\n";
+    }
+}
+
+void testCallerOutputs(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    // "upper" is the sole reader of "text", so it's moved unless kept
+    for (bool keep : { false, true }) {
+        queryplan::BuildOptions options;
+        options.outputs.insert("upper");
+        if (keep) {
+            options.outputs.insert("text");
+        }
+
+        queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+        queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+            planner(qp);
+
+        auto ctx = std::make_shared<queryplan::Context>(qp.numOutputs());
+        planner.run(ctx);
+
+        cout << "keep=" << keep << " text=\"" <<
+            any_cast<queryplan::ArenaString&>((*ctx)[qp.outputIndex("text")]) <<
+            "\" upper=\"" <<
+            any_cast<queryplan::ArenaString&>((*ctx)[qp.outputIndex("upper")]) <<
+            "\"\n";
+    }
+
+    queryplan::BuildOptions options;
+    options.outputs.insert("missing");
+    try {
+        queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+        assert(! "shouldn't reach here");
+    } catch (const std::invalid_argument& e) {
+        cout << e.what() << endl;
+    }
+}
+
+void testAsyncQueryPlanner(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::BuildOptions options;
+    options.outputs.insert("text");
+    options.outputs.insert("upper");
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(options, pt);
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+    queryplan::AsyncQueryPlanner<decltype(planner)> async(planner, 2, 4);
+
+    auto result = async.submit().get();
+    cout << "upper=" <<
+        result.output<queryplan::ArenaString>(qp.outputIndex("upper")) <<
+        " text=" <<
+        result.output<queryplan::ArenaString>(qp.outputIndex("text")) << "\n";
+
+    std::promise<void> all_done;
+    std::atomic_int pending(3);
+    size_t modules = result.statuses.size();
+    for (int i = 0; i < 3; ++i) {
+        bool posted = async.post([&](queryplan::QueryResult&& r,
+                                     std::exception_ptr e) {
+            assert(! e && r.statuses.size() == modules);
+            if (--pending == 0) {
+                all_done.set_value();
+            }
+        });
+        assert(posted);
+    }
+    all_done.get_future().wait();
+}
+
+void testBatchSink(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::system_error(errno, std::generic_category(), "pipe");
+    }
+
+    queryplan::BatchSink::Options options;
+    options.flush_interval = std::chrono::milliseconds(1000);
+    auto sink = std::make_shared<queryplan::BatchSink>(fds[1], true, options);
+    queryplan::getSinkRegistry().add("results", sink);
+
+    {
+        queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+        queryplan::MultiThreadBlockedQueryPlanner<queryplan::Module<>>
+            planner(qp, 4);
+        for (int i = 0; i < 100; ++i) {
+            planner();
+        }
+    }
+
+    sink->flush();
+    auto stats = sink->stats();
+    cout << "records=" << stats.records << " batched=" <<
+        (stats.batches < stats.records) << " pending=" << sink->pending() <<
+        "\n";
+
+    std::string text(stats.bytes, '\0');
+    for (size_t n = 0; n < text.size(); ) {
+        ssize_t r = read(fds[0], &text[n], text.size() - n);
+        assert(r > 0);
+        n += r;
+    }
+    cout << "lines=" << std::count(text.begin(), text.end(), '\n') << "\n";
+
+    queryplan::getSinkRegistry().remove("results");
+    sink.reset();
+    close(fds[0]);
+
+    // Nothing drains within the test, so appends past the bound are dropped.
+    options.flush_interval = std::chrono::milliseconds(60000);
+    options.max_buffered = 64;
+    options.overflow = queryplan::BatchSink::Overflow::Drop;
+    queryplan::BatchSink bounded(open("/dev/null", O_WRONLY), true, options);
+
+    std::string record(16, 'x');
+    for (int i = 0; i < 10; ++i) {
+        bounded.append(record);
+    }
+    cout << "bounded pending=" << bounded.pending() <<
+        " dropped=" << bounded.stats().dropped << "\n";
+}
+
+void testProcessModules(const char* filename)
+{
+    cout << __func__ << ": load query plan " << filename << endl;
+
+    ptree pt;
+    read_json(filename, pt);
+
+    queryplan::QueryPlan<queryplan::Module<>> qp(pt);
+    cout << "isolated=" << queryplan::isolateModules(qp, 2) << "\n";
+
+    queryplan::SingleThreadBlockedQueryPlanner<queryplan::Module<>>
+        planner(qp);
+
+    // the crash module kills its worker on every other call, and the hang
+    // module blocks its worker until the call times out
+    for (int i = 0; i < 4; ++i) {
+        dumpModuleStatuses(qp, planner);
+    }
+}
+
 int main(int argc, char** argv)
 {
     (void)argc;
@@ -218,6 +827,12 @@ int main(int argc, char** argv)
     cout << "\n";
     testRegisterModule();
 
+    cout << "\n";
+    testArena();
+
+    cout << "\n";
+    testMoveInput();
+
     cout << "\n";
     loadQueryPlan("t/qp-example.json");
 
@@ -251,11 +866,75 @@ int main(int argc, char** argv)
     cout << "\n";
     loadBadQueryPlan("t/qp-circular-dep.json");
 
+    cout << "\n";
+    loadBadQueryPlan("t/qp-broken-constructor.json");
+
+    cout << "\n";
+    testParallelBuild("t/qp-slow-init.json");
+
+    cout << "\n";
+    testSharedFunctors("t/qp-shared-functor.json");
+
+    cout << "\n";
+    testDeduplicateModules("t/qp-deduplicate.json");
+
+    cout << "\n";
+    testMergeQueryPlans("t/qp-example.json", "t/qp-deduplicate.json");
+
+    cout << "\n";
+    testMergeDeterministic("t/qp-merge.json");
+
     cout << "\n";
     testSingleThreadBlockedQueryPlanner("t/qp-example.json");
 
     cout << "\n";
     testSignalBasedSingleThreadBlockedQueryPlanner("t/qp-example.json");
 
+    cout << "\n";
+    testModuleFailure("t/qp-failure.json");
+
+    cout << "\n";
+    testSingleThreadBlockedQueryPlanner("t/qp-zero-copy.json");
+
+    cout << "\n";
+    testQueryProfiler("t/qp-zero-copy.json");
+
+    cout << "\n";
+    testQueryProfiler("t/qp-profile.json");
+
+    cout << "\n";
+    testQueryReplayer();
+
+    cout << "\n";
+    testHedgedModule("t/qp-hedge.json");
+
+    cout << "\n";
+    testAdmissionController(queryplan::AdmissionController::Priority::Strict);
+
+    cout << "\n";
+    testAdmissionController(
+            queryplan::AdmissionController::Priority::Weighted);
+
+    cout << "\n";
+    testProcessModules("t/qp-process.json");
+
+    cout << "\n";
+    testIncrementalSession("t/qp-incremental.json");
+
+    cout << "\n";
+    testIncrementalReset("t/qp-incremental-reset.json");
+
+    cout << "\n";
+    testMemoryBudget("t/qp-memory.json");
+
+    cout << "\n";
+    testCallerOutputs("t/qp-sole-reader.json");
+
+    cout << "\n";
+    testAsyncQueryPlanner("t/qp-sole-reader.json");
+
+    cout << "\n";
+    testBatchSink("t/qp-sink.json");
+
     return 0;
 }
@@ -0,0 +1,458 @@
+#ifndef MODULES__HPP__
+#define MODULES__HPP__
+
+/*
+ * Example modules shared by the test program and the replay tool.
+ */
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <boost/property_tree/ptree.hpp>
+#include "queryplan.hpp"
+#include "queryplan_replay.hpp"
+#include "queryplan_sink.hpp"
+
+struct Start {
+    void operator()(int& seed) {
+        seed = std::rand();
+    }
+};
+
+struct Extra {
+    void operator()(int seed, int& result) {
+        result = seed + std::rand();
+    }
+};
+
+struct Add {
+    void operator()(int a, int b, int& c) {
+        c = a + b;
+    }
+};
+
+// Every other call takes half a second, like a lookup with a heavy tail.
+struct SlowLookup {
+    void operator()(int key, int& value) {
+        static std::atomic_int calls(0);
+
+        if (calls++ % 2 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+        value = key / 2;
+    }
+};
+
+struct Fail {
+    bool operator()(int seed, int& result) {
+        return false;
+    }
+};
+
+struct Describe {
+    void operator()(int result, queryplan::ArenaString& text) {
+        std::ostringstream out;
+        out << "the result of this query is " << result;
+        text.assign(out.str().data(), out.str().size());
+    }
+};
+
+// Two outputs read by different modules.
+struct DescribeLength {
+    void operator()(int result, queryplan::ArenaString& text, int& length) {
+        std::ostringstream out;
+        out << "the result of this query is " << result;
+        text.assign(out.str().data(), out.str().size());
+        length = text.size();
+    }
+};
+
+struct Upper {
+    void operator()(queryplan::ArenaString text,
+                    queryplan::ArenaString& upper) {
+        for (auto& c : text) {
+            c = std::toupper(c);
+        }
+        upper = std::move(text);
+    }
+};
+
+struct OutputText {
+    void operator()(const queryplan::ArenaString& text) {
+        std::cout << "\ttext=" << text << std::endl;
+    }
+};
+
+struct Output {
+    void operator()(int result) {
+        std::cout << "\tresult=" << result << std::endl;
+    }
+};
+
+struct Output2 {
+    void operator()(long long result) {
+        std::cout << "\tresult=" << result << std::endl;
+    }
+};
+
+class DoSomething {
+public:
+    DoSomething(const boost::property_tree::ptree& config) : extra(0) {}
+
+    void operator()(int a, int b, int& c, std::ostream& out) {
+        c = a + b + extra;
+        out << "a=" << a << " b=" << b << " c=" << c << "\n";
+    }
+
+private:
+    int extra;
+};
+
+struct WorkerPid {
+    void operator()(int& pid) {
+        pid = getpid();
+    }
+};
+
+struct CheckPid {
+    void operator()(int pid) {
+        std::cout << "\tisolated=" << (pid != getpid()) << "\n";
+    }
+};
+
+// Kills its process on every other call, counted per process.
+struct Crash {
+    void operator()(int seed, int& result) {
+        static int calls = 0;
+        if (++calls % 2 == 0) {
+            raise(SIGKILL);
+        }
+        result = seed;
+    }
+};
+
+// Hangs on every other call, counted per process.
+struct Hang {
+    void operator()(int seed, int& result) {
+        static int calls = 0;
+        if (++calls % 2 == 0) {
+            for (;;) {
+                pause();
+            }
+        }
+        result = seed;
+    }
+};
+
+// Constructors like loading a lookup table from disk.
+// Records when each construction started and ended.
+struct SlowInit {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::vector<std::pair<Clock::time_point, Clock::time_point>> Spans;
+
+    SlowInit() {
+        auto start = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        std::lock_guard<std::mutex> lock(mutex());
+        spans().push_back(std::make_pair(start, Clock::now()));
+    }
+
+    static std::mutex& mutex() {
+        static std::mutex m;
+
+        return m;
+    }
+
+    static Spans& spans() {
+        static Spans s;
+
+        return s;
+    }
+
+    void operator()(int seed, int& result) {
+        result = seed / 2;
+    }
+};
+
+struct Broken {
+    Broken() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        throw std::runtime_error("Broken: can't load lookup table");
+    }
+
+    void operator()(int seed, int& result) {}
+};
+
+struct Broken2 {
+    Broken2() {
+        throw std::runtime_error("Broken2: can't load model");
+    }
+
+    void operator()(int seed, int& result) {}
+};
+
+// A read-only table built from the config, shared by equal configs.
+struct LookupTable {
+    explicit LookupTable(const boost::property_tree::ptree& config) :
+            table(config.get("table_size", 1024)) {
+        for (size_t i = 0; i < table.size(); ++i) {
+            table[i] = i * i;
+        }
+        ++constructions();
+    }
+
+    void operator()(int& size) const {
+        size = table.size();
+    }
+
+    static std::atomic_int& constructions() {
+        static std::atomic_int n(0);
+
+        return n;
+    }
+
+    std::vector<int> table;
+};
+
+// Modules of plans called with two int arguments.
+struct FirstArg {
+    void operator()(int& x, int first, int second) {
+        x = first;
+    }
+};
+
+struct SecondArg {
+    void operator()(int& x, int first, int second) {
+        x = second;
+    }
+};
+
+struct Parity {
+    void operator()(int x, int& parity, int first, int second) {
+        parity = x % 2;
+    }
+};
+
+struct Sum {
+    void operator()(int a, int b, int& c, int first, int second) {
+        c = a + b;
+    }
+};
+
+typedef queryplan::ArenaVector<queryplan::ArenaString> ArenaStrings;
+
+namespace queryplan {
+
+// For module traces, found through ArenaAllocator.
+inline std::ostream& operator<<(std::ostream& out, const ArenaStrings& v) {
+    return out << v.size() << " strings";
+}
+
+}   /* namespace queryplan */
+
+// "first" strings of "second" characters each, throws if "first" < 0.
+struct Repeat {
+    void operator()(ArenaStrings& words, int first, int second) {
+        if (first < 0) {
+            throw std::invalid_argument("Repeat: negative count");
+        }
+
+        words.assign(first, queryplan::ArenaString(second, 'x'));
+    }
+};
+
+// Needs a 4MiB scratch buffer for every query.
+struct BigAlloc {
+    void operator()(int seed, int& result) {
+        std::vector<char> scratch(4 << 20, 1);
+        result = seed + scratch.back();
+    }
+};
+
+// Like Output, but batched through the sink registered as "results".
+struct SinkOutput {
+    SinkOutput() : sink(queryplan::getSinkRegistry().find("results")) {}
+
+    void operator()(int result) {
+        char line[32];
+        int n = std::snprintf(line, sizeof(line), "result=%d\n", result);
+        sink->append(line, n);
+    }
+
+    queryplan::BatchSinkPtr sink;
+};
+
+QP_MODULE(DoSomethingModule, "DoSomethingModule", DoSomething,
+        ((QP_IN, int, a))
+        ((QP_IN, int, b))
+        ((QP_OUT, int&, c, 0))
+        , (std::ostream&),
+        const boost::property_tree::ptree&
+);
+
+QP_MODULE(StartModule, "StartModule", Start,
+        ((QP_OUT, int&, seed, 0))
+        , ()
+);
+
+QP_MODULE(ExtraModule, "ExtraModule", Extra,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(AddModule, "AddModule", Add,
+        ((QP_IN, int, a))
+        ((QP_IN, int, b))
+        ((QP_OUT, int&, c, 0))
+        , ()
+);
+
+QP_MODULE(SlowLookupModule, "SlowLookupModule", SlowLookup,
+        ((QP_IN, int, key))
+        ((QP_OUT, int&, value, 0))
+        , ()
+);
+
+QP_MODULE(FailModule, "FailModule", Fail,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(DescribeModule, "DescribeModule", Describe,
+        ((QP_IN, int, result))
+        ((QP_OUT, queryplan::ArenaString&, text, queryplan::ArenaString()))
+        , ()
+);
+
+QP_MODULE(DescribeLengthModule, "DescribeLengthModule", DescribeLength,
+        ((QP_IN, int, result))
+        ((QP_OUT, queryplan::ArenaString&, text, queryplan::ArenaString()))
+        ((QP_OUT, int&, length, 0))
+        , ()
+);
+
+QP_MODULE(UpperModule, "UpperModule", Upper,
+        ((QP_IN, queryplan::ArenaString, text))
+        ((QP_OUT, queryplan::ArenaString&, upper, queryplan::ArenaString()))
+        , ()
+);
+
+QP_MODULE(OutputTextModule, "OutputTextModule", OutputText,
+        ((QP_IN, const queryplan::ArenaString&, text))
+        , ()
+);
+
+QP_MODULE(OutputModule, "OutputModule", Output,
+        ((QP_IN, int, result))
+        , ()
+);
+
+QP_MODULE(Output2Module, "Output2Module", Output2,
+        ((QP_IN, long long, result))
+        , ()
+);
+
+QP_MODULE(WorkerPidModule, "WorkerPidModule", WorkerPid,
+        ((QP_OUT, int&, pid, 0))
+        , ()
+);
+
+QP_MODULE(CheckPidModule, "CheckPidModule", CheckPid,
+        ((QP_IN, int, pid))
+        , ()
+);
+
+QP_MODULE(CrashModule, "CrashModule", Crash,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(HangModule, "HangModule", Hang,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(SlowInitModule, "SlowInitModule", SlowInit,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(BrokenModule, "BrokenModule", Broken,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(Broken2Module, "Broken2Module", Broken2,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_SHARE_FUNCTOR(LookupTable);
+
+QP_MODULE(LookupTableModule, "LookupTableModule", LookupTable,
+        ((QP_OUT, int&, size, 0))
+        , (),
+        const boost::property_tree::ptree&
+);
+
+QP_MODULE(FirstArgModule, "FirstArgModule", FirstArg,
+        ((QP_OUT, int&, x, 0))
+        , (int, int)
+);
+
+QP_MODULE(SecondArgModule, "SecondArgModule", SecondArg,
+        ((QP_OUT, int&, x, 0))
+        , (int, int)
+);
+
+QP_MODULE(ParityModule, "ParityModule", Parity,
+        ((QP_IN, int, x))
+        ((QP_OUT, int&, parity, 0))
+        , (int, int)
+);
+
+QP_MODULE(SumModule, "SumModule", Sum,
+        ((QP_IN, int, a))
+        ((QP_IN, int, b))
+        ((QP_OUT, int&, c, 0))
+        , (int, int)
+);
+
+QP_MODULE(RepeatModule, "RepeatModule", Repeat,
+        ((QP_OUT, ArenaStrings&, words, ArenaStrings()))
+        , (int, int)
+);
+
+QP_REGISTER_REPLAY("int,int", int, int);
+
+QP_MODULE(BigAllocModule, "BigAllocModule", BigAlloc,
+        ((QP_IN, int, seed))
+        ((QP_OUT, int&, result, 0))
+        , ()
+);
+
+QP_MODULE(SinkOutputModule, "SinkOutputModule", SinkOutput,
+        ((QP_IN, int, result))
+        , ()
+);
+
+#endif  /* MODULES__HPP__ */
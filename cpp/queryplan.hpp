@@ -21,24 +21,36 @@
 #endif
 
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <ctime>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <typeinfo>
 #include <utility>
 #include <vector>
 #include <boost/any.hpp>
 #include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/copy.hpp>
 #include <boost/graph/graph_traits.hpp>
 #include <boost/graph/graphviz.hpp>
 #include <boost/graph/topological_sort.hpp>
@@ -62,6 +74,14 @@
 #define QP_TRACER           std::cerr
 #endif
 
+#ifndef QP_ARENA_BLOCK_SIZE
+#define QP_ARENA_BLOCK_SIZE         (64 * 1024)
+#endif
+
+#ifndef QP_ARENA_CACHED_BLOCKS
+#define QP_ARENA_CACHED_BLOCKS      16
+#endif
+
 
 namespace queryplan {
 
@@ -87,17 +107,558 @@ public:
 };
 
 
-typedef std::vector<boost::any> Context;
-typedef std::shared_ptr<std::vector<boost::any>> ContextPtr;
+/*
+ * Heap and arena bytes the modules of one query may hold.  Allocations
+ * are charged while modules run, frees are credited back.  Once the limit
+ * is passed, Policy::Abort fails the allocation, and Policy::Degrade lets
+ * the running module finish but skips modules that haven't started, so
+ * their dependents are skipped too.
+ */
+class MemoryBudgetExceeded : public std::bad_alloc {
+public:
+    const char* what() const noexcept {
+        return "query memory budget exceeded";
+    }
+};
+
+class MemoryBudget {
+public:
+    enum class Policy {
+        Abort,
+        Degrade
+    };
+
+    MemoryBudget(size_t limit, Policy policy) :
+        limit_(limit), policy_(policy), used_(0), exceeded_(false) {}
+
+    void charge(long long bytes) {
+        long long used = used_ += bytes;
+
+        if (bytes > 0 && used > limit_) {
+            exceeded_ = true;
+            if (policy_ == Policy::Abort) {
+                throw MemoryBudgetExceeded();
+            }
+        }
+    }
+
+    // Whether the limit was ever passed, even if memory was freed since.
+    bool exhausted() const {
+        return exceeded_;
+    }
+
+    long long used() const {
+        return used_;
+    }
+
+    Policy policy() const {
+        return policy_;
+    }
+
+private:
+    const long long limit_;
+    const Policy policy_;
+    std::atomic<long long> used_;
+    std::atomic<bool> exceeded_;
+};
+
+
+/*
+ * Counts what the module running on this thread allocates.  Arena
+ * allocations are always counted, heap allocations only in programs that
+ * expand QP_DEFINE_MEMORY_HOOKS() once.
+ */
+class MemoryAccount {
+public:
+    explicit MemoryAccount(MemoryBudget* budget = nullptr) :
+        allocated(0), freed(0), budget(budget) {}
+
+    void allocate(size_t bytes) {
+        if (budget) {
+            budget->charge(bytes);
+        }
+        allocated += bytes;
+    }
+
+    void deallocate(size_t bytes) {
+        if (budget) {
+            budget->charge(-static_cast<long long>(bytes));
+        }
+        freed += bytes;
+    }
+
+    static MemoryAccount*& current() {
+        static thread_local MemoryAccount* account = nullptr;
+        return account;
+    }
+
+    // Counts into "account" until destroyed, or stops counting if null.
+    class Scope {
+    public:
+        Scope(MemoryAccount* account) : saved(current()) {
+            current() = account;
+        }
+        ~Scope() { current() = saved; }
+
+    private:
+        MemoryAccount* saved;
+    };
+
+    size_t allocated;
+    size_t freed;
+    MemoryBudget* budget;
+};
+
+
+// Heap blocks remember their size for the account of whoever frees them.
+inline void* allocateCounted(size_t bytes) {
+    const size_t header = alignof(std::max_align_t);
+
+    if (MemoryAccount* account = MemoryAccount::current()) {
+        account->allocate(bytes);
+    }
+
+    void* p = std::malloc(bytes + header);
+    if (! p) {
+        throw std::bad_alloc();
+    }
+
+    *static_cast<size_t*>(p) = bytes;
+    return static_cast<char*>(p) + header;
+}
+
+inline void deallocateCounted(void* p) noexcept {
+    const size_t header = alignof(std::max_align_t);
+
+    if (! p) {
+        return;
+    }
+
+    char* block = static_cast<char*>(p) - header;
+    if (MemoryAccount* account = MemoryAccount::current()) {
+        account->deallocate(*reinterpret_cast<size_t*>(block));
+    }
+
+    std::free(block);
+}
+
+
+/*
+ * Monotonic allocator for values that live as long as one query.  Memory
+ * is given back only when the arena is destroyed, and its regular sized
+ * blocks are then cached by the destroying thread for later arenas.
+ */
+class Arena {
+public:
+    Arena() : ptr(nullptr), left(0), allocated(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        BlockCache& cache = blockCache();
+
+        for (auto& b : blocks) {
+            if (b.second == QP_ARENA_BLOCK_SIZE &&
+                    cache.blocks.size() < QP_ARENA_CACHED_BLOCKS) {
+                cache.blocks.push_back(b.first);
+            } else {
+                ::operator delete(b.first);
+            }
+        }
+    }
+
+    void* allocate(size_t bytes, size_t alignment) {
+        if (MemoryAccount* account = MemoryAccount::current()) {
+            account->allocate(bytes);
+        }
+
+        Lock lock(busy);
+
+        size_t pad = (alignment - reinterpret_cast<uintptr_t>(ptr) %
+                alignment) % alignment;
+        if (pad + bytes > left) {
+            grow(bytes + alignment);
+            pad = (alignment - reinterpret_cast<uintptr_t>(ptr) %
+                    alignment) % alignment;
+        }
+
+        char* p = ptr + pad;
+        ptr = p + bytes;
+        left -= pad + bytes;
+        allocated += bytes;
+
+        return p;
+    }
+
+    size_t bytesAllocated() const {
+        return allocated;
+    }
+
+    // The arena used by ArenaAllocator instances created on this thread.
+    static Arena*& current() {
+        static thread_local Arena* arena = nullptr;
+        return arena;
+    }
+
+    class Scope {
+    public:
+        Scope(Arena& arena) : saved(current()) { current() = &arena; }
+        ~Scope() { current() = saved; }
+
+    private:
+        Arena* saved;
+    };
+
+private:
+    struct BlockCache {
+        std::vector<char*> blocks;
+
+        ~BlockCache() {
+            for (auto b : blocks) {
+                ::operator delete(b);
+            }
+        }
+    };
+
+    // planners may run modules of one query on several threads
+    class Lock {
+    public:
+        Lock(std::atomic_flag& f) : flag(f) {
+            while (flag.test_and_set(std::memory_order_acquire)) {
+            }
+        }
+
+        ~Lock() { flag.clear(std::memory_order_release); }
+
+    private:
+        std::atomic_flag& flag;
+    };
+
+    static BlockCache& blockCache() {
+        static thread_local BlockCache cache;
+        return cache;
+    }
+
+    void grow(size_t bytes) {
+        size_t size = bytes > QP_ARENA_BLOCK_SIZE ?
+            bytes : QP_ARENA_BLOCK_SIZE;
+        BlockCache& cache = blockCache();
+        char* block;
+
+        if (size == QP_ARENA_BLOCK_SIZE && ! cache.blocks.empty()) {
+            block = cache.blocks.back();
+            cache.blocks.pop_back();
+        } else {
+            // the bytes were counted by allocate()
+            MemoryAccount::Scope uncounted(nullptr);
+            block = static_cast<char*>(::operator new(size));
+        }
+
+        blocks.push_back(std::make_pair(block, size));
+        ptr = block;
+        left = size;
+    }
+
+    std::vector<std::pair<char*, size_t>> blocks;
+    char* ptr;
+    size_t left;
+    size_t allocated;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+};
+
+
+/*
+ * Standard allocator backed by an Arena.  A default constructed one uses
+ * the arena of the module that is running, so module outputs declared as
+ * ArenaString or ArenaVector are released with their query's Context and
+ * must not be kept after it; outside of modules it falls back to the heap.
+ */
+template<typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator() : arena(Arena::current()) {}
+    ArenaAllocator(Arena* a) : arena(a) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena) {
+            return static_cast<T*>(arena->allocate(n * sizeof(T),
+                        alignof(T)));
+        } else {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (! arena) {
+            ::operator delete(p);
+        }
+    }
+
+    Arena* arena;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
+}
+
+typedef std::basic_string<char, std::char_traits<char>,
+        ArenaAllocator<char>> ArenaString;
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+
+class Context;
+
+class ContextArena {
+protected:
+    Arena arena_;
+    std::shared_ptr<Context> parent_;
+    std::shared_ptr<MemoryBudget> budget_;
+};
+
+// The arena is a base listed first so it outlives the values.
+class Context : private ContextArena, public std::vector<boost::any> {
+public:
+    Context() {}
+    explicit Context(size_t n) : std::vector<boost::any>(n) {}
+
+    // A scratch context allocating from, and keeping alive, its parent.
+    Context(size_t n, std::shared_ptr<Context> parent) :
+            std::vector<boost::any>(n) {
+        parent_ = parent;
+    }
+
+    Arena& arena() {
+        return parent_ ? parent_->arena() : arena_;
+    }
+
+    // Whether modules may move input values out of slots they read alone.
+    bool movable() const {
+        return movable_;
+    }
+
+    void setMovable(bool movable) {
+        movable_ = movable;
+    }
+
+    // Scratch contexts charge their parent's budget.
+    MemoryBudget* memoryBudget() {
+        return parent_ ? parent_->memoryBudget() : budget_.get();
+    }
+
+    void setMemoryBudget(std::shared_ptr<MemoryBudget> budget) {
+        budget_ = budget;
+    }
+
+private:
+    bool movable_ = true;
+};
+
+
+// Memory budget settings of a planner, applied to each query's context.
+struct MemoryLimit {
+    size_t bytes = 0;       // 0 for unlimited
+    MemoryBudget::Policy policy = MemoryBudget::Policy::Abort;
+
+    void apply(Context& ctx) const {
+        if (bytes > 0) {
+            ctx.setMemoryBudget(std::make_shared<MemoryBudget>(bytes, policy));
+        }
+    }
+};
+
+
+/*
+ * Inputs declared as references bind to the context slot directly, inputs
+ * declared by value are moved out of the slot if it's movable, otherwise
+ * copied.
+ */
+template<typename T>
+typename std::enable_if<std::is_reference<T>::value, T>::type
+inputValue(boost::any& any, bool movable) {
+    auto p = boost::any_cast<typename std::remove_reference<T>::type>(&any);
+    if (! p) {
+        throw boost::bad_any_cast();
+    }
+
+    return *p;
+}
+
+template<typename T>
+typename std::enable_if<! std::is_reference<T>::value, T>::type
+inputValue(boost::any& any, bool movable) {
+    auto p = boost::any_cast<typename std::remove_cv<T>::type>(&any);
+    if (! p) {
+        throw boost::bad_any_cast();
+    }
+
+    if (movable) {
+        return std::move(*p);
+    } else {
+        return *p;
+    }
+}
+
+typedef std::shared_ptr<Context> ContextPtr;
+
+
+/*
+ * Approximate memory held by a value, used to report sizes of module
+ * outputs.  Overload it for your own types next to their definition.
+ */
+template<typename T>
+size_t byteSize(const T& v) {
+    return sizeof(v);
+}
+
+template<typename C, typename T, typename A>
+size_t byteSize(const std::basic_string<C, T, A>& s) {
+    return sizeof(s) + s.capacity() * sizeof(C);
+}
+
+template<typename T, typename A>
+size_t byteSize(const std::vector<T, A>& v) {
+    size_t n = sizeof(v) + (v.capacity() - v.size()) * sizeof(T);
+    for (auto& e : v) {
+        n += byteSize(e);
+    }
+
+    return n;
+}
+
+template<typename K, typename V, typename L, typename A>
+size_t byteSize(const std::map<K, V, L, A>& m) {
+    // plus a red-black tree node header per entry
+    size_t n = sizeof(m) + m.size() * 4 * sizeof(void*);
+    for (auto& e : m) {
+        n += byteSize(e.first) + byteSize(e.second);
+    }
+
+    return n;
+}
+
+
+/*
+ * Whether values of T can be copied and compared with ==, which is how
+ * IncrementalSession detects unchanged arguments and module outputs.
+ */
+template<typename T>
+struct IsComparable {
+private:
+    template<typename U>
+    static auto test(int) -> decltype(
+            static_cast<bool>(std::declval<const U&>() ==
+                std::declval<const U&>()), std::true_type());
+
+    template<typename>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<T>(0))::value &&
+        std::is_copy_constructible<T>::value;
+};
+
+// False unless both hold equal values of type T.
+template<typename T>
+typename std::enable_if<IsComparable<T>::value, bool>::type
+anyEqual(const boost::any& a, const boost::any& b) {
+    auto pa = boost::any_cast<T>(&a);
+    auto pb = boost::any_cast<T>(&b);
+
+    return pa && pb && *pa == *pb;
+}
+
+template<typename T>
+typename std::enable_if<! IsComparable<T>::value, bool>::type
+anyEqual(const boost::any&, const boost::any&) {
+    return false;
+}
+
+
+/*
+ * A module fails without throwing by returning false from its functor,
+ * then planners skip every module that depends on it.
+ */
+enum class ModuleStatus {
+    Succeeded,
+    Failed,
+    Skipped
+};
+
+inline std::ostream& operator<<(std::ostream& out, ModuleStatus status) {
+    switch (status) {
+    case ModuleStatus::Succeeded:   return out << "succeeded";
+    case ModuleStatus::Failed:      return out << "failed";
+    case ModuleStatus::Skipped:     return out << "skipped";
+    }
+
+    return out << "unknown";
+}
+
+
+// Functors returning void always succeed, others return success as bool.
+template<typename F, typename... T>
+auto invokeFunctor(F& f, T&&... t) -> typename std::enable_if<
+        std::is_void<decltype(f(std::forward<T>(t)...))>::value, bool>::type {
+    f(std::forward<T>(t)...);
+    return true;
+}
+
+template<typename F, typename... T>
+auto invokeFunctor(F& f, T&&... t) -> typename std::enable_if<
+        ! std::is_void<decltype(f(std::forward<T>(t)...))>::value, bool>::type {
+    return static_cast<bool>(f(std::forward<T>(t)...));
+}
+
+
+// Context slot and byte size of each output of a module.
+typedef std::vector<std::pair<int, size_t>> OutputBytes;
 
 
 template<typename... A>
 class Module {
 public:
-    virtual void resolve(const std::map<std::string, int>& m) = 0;
-    virtual void operator()(ContextPtr ctx, A... a) = 0;
+    // Planner arguments passed to every call.
+    static constexpr size_t numArguments = sizeof...(A);
+
+    // "movables" names inputs whose slot isn't read by any other module.
+    virtual void resolve(const std::map<std::string, int>& m,
+                         const std::set<std::string>& movables) = 0;
+
+    void resolve(const std::map<std::string, int>& m) {
+        resolve(m, std::set<std::string>());
+    }
+
+    // Reads inputs from "ctx" and writes outputs to "out", so a planner
+    // may keep outputs apart; inputs are only moved when "out" is *ctx.
+    virtual bool operator()(ContextPtr ctx, Context& out, A... a) = 0;
+
+    bool operator()(ContextPtr ctx, A... a) {
+        return (*this)(ctx, *ctx, a...);
+    }
+
     virtual const std::string& id() const = 0;
     virtual ~Module() {}
+
+    virtual void outputBytes(const Context& ctx, OutputBytes& bytes) const {}
+
+    // Whether this module's outputs in "a" and "b" compare equal.
+    virtual bool outputsEqual(const Context& a, const Context& b) const {
+        return false;
+    }
 };
 
 
@@ -180,83 +741,466 @@ private:
 };
 
 
-template<typename M, typename... C>
-class QueryPlan {
-public:
-    typedef boost::adjacency_list<boost::vecS, boost::vecS,
-            boost::bidirectionalS, std::shared_ptr<M>> Graph;
-
-    QueryPlan(const boost::property_tree::ptree& config, C... c) {
-        G dependencies;
-        std::map<std::string, OutputInfo> outputInfos;
-        std::map<Vertex, const std::vector<ArgInfo>*> argInfos;
-
-        createModulesAndRecordOutputs(config, dependencies,
-                outputInfos, argInfos, c...);
+// Key order of JSON objects is insignificant, so children are sorted,
+// and every string is length prefixed to keep the result unambiguous.
+inline std::string fingerprint(const boost::property_tree::ptree& pt) {
+    std::vector<std::pair<std::string, std::string>> children;
+    for (auto& child : pt) {
+        children.push_back(
+                std::make_pair(child.first, fingerprint(child.second)));
+    }
+    std::stable_sort(children.begin(), children.end(),
+            [](const std::pair<std::string, std::string>& a,
+               const std::pair<std::string, std::string>& b) {
+                return a.first < b.first;
+            });
+
+    std::ostringstream out;
+    out << pt.data().size() << ':' << pt.data() << '{';
+    for (auto& child : children) {
+        out << child.first.size() << ':' << child.first <<
+            child.second;
+    }
+    out << '}';
 
-        connectInputsOutputs(config, dependencies,
-                outputInfos, argInfos);
+    return out.str();
+}
 
-        checkCircularDependency(dependencies);
 
-        boost::copy_graph(dependencies, graph);
+/*
+ * Appends an unambiguous encoding of a module constructor argument to a
+ * cache key, or returns false if arguments of type T can't be compared.
+ */
+template<typename T, typename Enable = void>
+struct ArgumentFingerprint {
+    static bool append(std::string&, const T&) {
+        return false;
     }
+};
 
-    int numOutputs() {
-        return num_outputs;
+template<typename T>
+struct ArgumentFingerprint<T,
+        typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    static bool append(std::string& key, const T& v) {
+        // enough digits that distinct floating point values stay distinct
+        std::ostringstream out;
+        out << std::setprecision(std::numeric_limits<T>::max_digits10) <<
+            v << ';';
+        key += out.str();
+        return true;
     }
+};
 
-    Graph& dependencies() {
-        return graph;
+template<>
+struct ArgumentFingerprint<std::string> {
+    static bool append(std::string& key, const std::string& s) {
+        key += std::to_string(s.size()) + ':' + s;
+        return true;
     }
+};
 
-    void writeGraphviz(std::ostream& out) {
-        writeGraphviz(out, graph);
+template<>
+struct ArgumentFingerprint<boost::property_tree::ptree> {
+    static bool append(std::string& key,
+                       const boost::property_tree::ptree& pt) {
+        key += fingerprint(pt);
+        return true;
     }
+};
 
-private:
-    typedef boost::adjacency_list<boost::setS, boost::vecS,
-            boost::directedS, std::shared_ptr<M>> G;
-    typedef typename G::vertex_descriptor Vertex;
 
-    struct OutputInfo {
-        Vertex module;
-        int index;
-        const ArgInfo& arginfo;
+// Specialized by QP_SHARE_FUNCTOR() for read-only, thread-safe functors.
+template<typename F>
+struct IsSharedFunctor : std::false_type {};
 
-        OutputInfo(Vertex m, int i, const ArgInfo& a) :
-            module(m), index(i), arginfo(a) {}
-    };
 
-    struct VertexPropertyWriter {
-        const Graph& graph;
+/*
+ * Creates module functors.  Functors marked with QP_SHARE_FUNCTOR() are
+ * shared by every module, in any plan, constructed from equal arguments,
+ * and destroyed with the last module holding them.
+ */
+template<typename F>
+class FunctorCache {
+public:
+    template<typename... C>
+    static std::shared_ptr<F> get(C... c) {
+        std::string key;
+        if (! IsSharedFunctor<F>::value || ! fingerprintAll(key, c...)) {
+            return std::make_shared<F>(c...);
+        }
 
-        VertexPropertyWriter(const Graph& g) : graph(g) {}
+        FunctorCache& cache = instance();
+        std::shared_ptr<Entry> entry;
+        {
+            std::lock_guard<std::mutex> lock(cache.m);
+            cache.purge();
 
-        void operator()(std::ostream& out,
-                        const typename Graph::vertex_descriptor& v) {
-            out << "[label=\"" << graph[v]->id() << "\"]";
+            auto& e = cache.entries[key];
+            if (! e) {
+                e = std::make_shared<Entry>();
+            }
+            entry = e;
         }
-    };
 
-    template<typename T>
+        // equal keys wait for one construction, other keys don't
+        std::lock_guard<std::mutex> lock(entry->m);
+        std::shared_ptr<F> f = entry->functor.lock();
+        if (! f) {
+            f = std::make_shared<F>(c...);
+            entry->functor = f;
+        }
+
+        return f;
+    }
+
+    // Number of live shared functors.
+    static size_t size() {
+        FunctorCache& cache = instance();
+        std::lock_guard<std::mutex> lock(cache.m);
+
+        size_t n = 0;
+        for (auto& e : cache.entries) {
+            std::lock_guard<std::mutex> entry_lock(e.second->m);
+            n += ! e.second->functor.expired();
+        }
+
+        return n;
+    }
+
+private:
+    struct Entry {
+        std::weak_ptr<F> functor;
+        std::mutex m;
+    };
+
+    static FunctorCache& instance() {
+        static FunctorCache cache;
+
+        return cache;
+    }
+
+    static bool fingerprintAll(std::string&) {
+        return true;
+    }
+
+    template<typename T, typename... Rest>
+    static bool fingerprintAll(std::string& key, const T& v,
+                               const Rest&... rest) {
+        return ArgumentFingerprint<typename std::decay<T>::type>::append(
+                key, v) && fingerprintAll(key, rest...);
+    }
+
+    // Drops entries of released functors nobody is constructing, must
+    // hold "m".
+    void purge() {
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if (it->second.use_count() == 1 &&
+                    it->second->functor.expired()) {
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::map<std::string, std::shared_ptr<Entry>> entries;
+    std::mutex m;
+};
+
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t n = std::thread::hardware_concurrency()) :
+            busy(0), stopping(false) {
+        if (n == 0) {
+            n = 1;
+        }
+
+        threads.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            threads.push_back(std::thread(&ThreadPool::work, this));
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Finishes queued tasks before the threads exit.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wakeup.notify_all();
+
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [this] { return tasks.empty() && busy == 0; });
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock(m);
+
+        for (;;) {
+            wakeup.wait(lock, [this] { return stopping || ! tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            ++busy;
+
+            lock.unlock();
+            task();
+            lock.lock();
+
+            if (--busy == 0 && tasks.empty()) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    size_t busy;
+    bool stopping;
+    std::mutex m;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+};
+
+
+// How a QueryPlan constructs its modules.
+struct BuildOptions {
+    BuildOptions() : threads(1) {}
+
+    // Threads running module constructors, 0 for one per hardware thread.
+    // Constructors of a plan built by more than one thread run
+    // concurrently, so they must be thread-safe.
+    size_t threads;
+
+    // Global names the caller reads from the context after a query, so
+    // that a sole reader never moves them out.  Other inputs with one
+    // reader may be moved, leaving an empty value behind.
+    std::set<std::string> outputs;
+};
+
+// Module constructors of a plan threw, the message lists them all.
+class ModuleConstructionError : public std::runtime_error {
+public:
+    // Module id and what its constructor threw, in plan order.
+    typedef std::vector<std::pair<std::string, std::exception_ptr>> Errors;
+
+    explicit ModuleConstructionError(const Errors& errors) :
+        std::runtime_error(describe(errors)), errors_(errors) {}
+
+    const Errors& errors() const {
+        return errors_;
+    }
+
+private:
+    static std::string describe(const Errors& errors) {
+        std::string msg;
+
+        for (auto& e : errors) {
+            msg += (msg.empty() ? "" : "\n") + std::string("module \"") +
+                e.first + "\" can't be constructed: ";
+            try {
+                std::rethrow_exception(e.second);
+            } catch (std::exception& x) {
+                msg += x.what();
+            } catch (...) {
+                msg += "unknown exception";
+            }
+        }
+
+        return msg;
+    }
+
+    Errors errors_;
+};
+
+
+template<typename M, typename... C>
+class QueryPlan {
+public:
+    typedef boost::adjacency_list<boost::vecS, boost::vecS,
+            boost::bidirectionalS, std::shared_ptr<M>> Graph;
+
+    typedef std::vector<std::pair<std::string,
+            boost::property_tree::ptree>> Plans;
+
+    QueryPlan(const boost::property_tree::ptree& config, C... c) :
+            QueryPlan(BuildOptions(), config, c...) {
+    }
+
+    QueryPlan(const BuildOptions& options,
+              const boost::property_tree::ptree& config, C... c) :
+            num_deduplicated(0) {
+        build(options, config, c...);
+    }
+
+    /*
+     * Merges several named plans into one graph.  Ids and global names
+     * of plan "name" are prefixed with "name/", so each plan's outputs
+     * stay reachable through outputIndex("name/global").  Modules with
+     * outputs are shared between plans when their module, settings and
+     * input bindings match and at least one of them is marked
+     * "deterministic", like duplicates within one plan.
+     */
+    QueryPlan(const Plans& plans, C... c) :
+            QueryPlan(BuildOptions(), plans, c...) {
+    }
+
+    QueryPlan(const BuildOptions& options, const Plans& plans, C... c) :
+            num_deduplicated(0) {
+        boost::property_tree::ptree config;
+
+        for (auto& plan : plans) {
+            const std::string prefix = plan.first + '/';
+
+            for (auto& it : plan.second) {
+                boost::property_tree::ptree entry(it.second);
+                const std::string& id = it.second.get<std::string>("id");
+
+                entry.put("id", prefix + id);
+
+                prefixGlobalNames(entry, "inputs", prefix);
+                prefixGlobalNames(entry, "outputs", prefix);
+
+                config.push_back(std::make_pair("", entry));
+            }
+        }
+
+        build(options, config, c...);
+    }
+
+    int numOutputs() const {
+        return num_outputs;
+    }
+
+    int numDeduplicated() const {
+        return num_deduplicated;
+    }
+
+    int outputIndex(const std::string& globalName) const {
+        auto it = output_indexes.find(resolveAlias(globalName));
+        if (it == output_indexes.end()) {
+            throw std::invalid_argument("global name \"" + globalName +
+                    "\" doesn't bind to any known output");
+        }
+
+        return it->second;
+    }
+
+    Graph& dependencies() {
+        return graph;
+    }
+
+    const Graph& dependencies() const {
+        return graph;
+    }
+
+    // The plan entry a module was created from.
+    const boost::property_tree::ptree& settings(
+            typename Graph::vertex_descriptor v) const {
+        return entries.at(v);
+    }
+
+    const std::vector<int>& inputSlots(
+            typename Graph::vertex_descriptor v) const {
+        return input_slots.at(v);
+    }
+
+    const std::vector<int>& outputSlots(
+            typename Graph::vertex_descriptor v) const {
+        return output_slots.at(v);
+    }
+
+    void writeGraphviz(std::ostream& out) {
+        writeGraphviz(out, graph);
+    }
+
+private:
+    // Dependencies between module ids, checked before any module exists.
+    typedef boost::adjacency_list<boost::setS, boost::vecS,
+            boost::directedS, std::string> G;
+    typedef typename G::vertex_descriptor Vertex;
+    typedef ModuleFactory<M, C...> Factory;
+
+    struct OutputInfo {
+        Vertex module;
+        int index;
+        const ArgInfo& arginfo;
+
+        OutputInfo(Vertex m, int i, const ArgInfo& a) :
+            module(m), index(i), arginfo(a) {}
+    };
+
+    // Context slots of a module's local names, and inputs it may move.
+    struct Binding {
+        std::map<std::string, int> slots;
+        std::set<std::string> movables;
+    };
+
+    static const std::string& label(const std::shared_ptr<M>& module) {
+        return module->id();
+    }
+
+    static const std::string& label(const std::string& id) {
+        return id;
+    }
+
+    template<typename T>
+    struct VertexPropertyWriter {
+        const T& graph;
+
+        VertexPropertyWriter(const T& g) : graph(g) {}
+
+        void operator()(std::ostream& out,
+                        const typename T::vertex_descriptor& v) {
+            out << "[label=\"" << label(graph[v]) << "\"]";
+        }
+    };
+
+    template<typename T>
     static void writeGraphviz(std::ostream& out, const T& graph) {
 #ifdef QP_ENABLE_BOOST_WRITE_GRAPHVIZ
         // its output isn't easy to grep due to numbered vertex ID.
-        boost::write_graphviz(out, graph, VertexPropertyWriter(graph));
+        boost::write_graphviz(out, graph, VertexPropertyWriter<T>(graph));
 #else
 
         out << "digraph G {\n";
 
         typename boost::graph_traits<T>::vertex_iterator v, v_end;
         for (std::tie(v, v_end) = boost::vertices(graph); v != v_end; ++v) {
-            out << "  \"" << graph[*v]->id() << "\";\n";
+            out << "  \"" << label(graph[*v]) << "\";\n";
 
-            std::string parent = "\t\t\"" + graph[*v]->id() + "\" -> \"";
+            std::string parent = "\t\t\"" + label(graph[*v]) + "\" -> \"";
             typename boost::graph_traits<T>::adjacency_iterator a, a_end;
 
             for (std::tie(a, a_end) = boost::adjacent_vertices(*v, graph); a != a_end; ++a) {
-                out << parent << graph[*a]->id() << "\";\n";
+                out << parent << label(graph[*a]) << "\";\n";
             }
         }
 
@@ -264,12 +1208,208 @@ private:
 #endif
     }
 
-    void createModulesAndRecordOutputs(
+    /*
+     * Validates the whole plan, bindings, types and cycles included, before
+     * constructing any module, as constructors may be slow or have side
+     * effects.
+     */
+    void build(const BuildOptions& options,
+               const boost::property_tree::ptree& config, C... c) {
+        G dependencies;
+        std::map<std::string, OutputInfo> outputInfos;
+        std::vector<const Factory*> factories;
+        std::vector<Binding> bindings;
+
+        boost::property_tree::ptree plan =
+            eliminateDuplicateModules(config);
+
+        recordOutputs(plan, dependencies, outputInfos, factories);
+
+        for (auto& it : plan) {
+            entries.push_back(it.second);
+        }
+        input_slots.resize(entries.size());
+        output_slots.resize(entries.size());
+
+        connectInputsOutputs(plan, dependencies,
+                outputInfos, factories, bindings, options.outputs);
+
+        checkCircularDependency(dependencies);
+
+        auto modules = createModules(options, dependencies, factories, c...);
+
+        for (size_t v = 0; v < modules.size(); ++v) {
+            modules[v]->resolve(bindings[v].slots, bindings[v].movables);
+            boost::add_vertex(modules[v], graph);
+        }
+
+        typename boost::graph_traits<G>::edge_iterator e, e_end;
+        for (std::tie(e, e_end) = boost::edges(dependencies); e != e_end; ++e) {
+            boost::add_edge(boost::source(*e, dependencies),
+                    boost::target(*e, dependencies), graph);
+        }
+
+        num_outputs = outputInfos.size();
+
+        for (auto& oi : outputInfos) {
+            output_indexes[oi.first] = oi.second.index;
+        }
+    }
+
+    static void prefixGlobalNames(boost::property_tree::ptree& entry,
+                                  const char* key,
+                                  const std::string& prefix) {
+        auto names = entry.find(key);
+        if (names == entry.not_found()) {
+            return;
+        }
+
+        for (auto& name : names->second) {
+            name.second.put_value(
+                    prefix + name.second.get_value<std::string>());
+        }
+    }
+
+    /*
+     * Removes plan entries that repeat an earlier entry's module, settings
+     * and input bindings when either of the two is marked "deterministic",
+     * and rebinds readers of their outputs to the outputs of the entry that
+     * is kept.  Repeats until no more duplicates show up, because
+     * rebinding can make downstream entries identical too.
+     */
+    boost::property_tree::ptree eliminateDuplicateModules(
+            const boost::property_tree::ptree& config) {
+        boost::property_tree::ptree plan(config);
+        std::map<std::string, int> producers;
+
+        for (auto& it : plan) {
+            auto outputs = it.second.find("outputs");
+            if (outputs == it.second.not_found()) {
+                continue;
+            }
+
+            for (auto& output : outputs->second) {
+                ++producers[output.second.get_value<std::string>()];
+            }
+        }
+
+        bool found = true;
+        while (found) {
+            found = false;
+            std::map<std::string, const boost::property_tree::ptree*> kept;
+
+            for (auto it = plan.begin(); it != plan.end(); ) {
+                auto& entry = it->second;
+                rebindInputs(entry);
+
+                if (! isDeduplicable(entry, producers)) {
+                    ++it;
+                    continue;
+                }
+
+                std::string signature = moduleSignature(entry);
+                auto old = kept.find(signature);
+                if (old == kept.end()) {
+                    kept.insert(std::make_pair(signature, &entry));
+                    ++it;
+                } else if ((isDeterministic(entry) ||
+                            isDeterministic(*old->second)) &&
+                        aliasOutputs(entry, *old->second)) {
+                    found = true;
+                    ++num_deduplicated;
+                    it = plan.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        return plan;
+    }
+
+    static bool isDeterministic(const boost::property_tree::ptree& entry) {
+        return entry.get<bool>("deterministic", false);
+    }
+
+    bool isDeduplicable(const boost::property_tree::ptree& entry,
+                        const std::map<std::string, int>& producers) {
+        auto outputs = entry.find("outputs");
+        if (outputs == entry.not_found() || outputs->second.empty()) {
+            return false;
+        }
+
+        // leave conflicting outputs to recordOutputs()
+        for (auto& output : outputs->second) {
+            if (producers.at(output.second.get_value<std::string>()) != 1) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool aliasOutputs(const boost::property_tree::ptree& duplicate,
+                      const boost::property_tree::ptree& original) {
+        auto& from = duplicate.get_child("outputs");
+        auto& to = original.get_child("outputs");
+
+        if (from.size() != to.size()) {
+            return false;
+        }
+
+        for (auto& output : from) {
+            if (to.find(output.first) == to.not_found()) {
+                return false;
+            }
+        }
+
+        for (auto& output : from) {
+            aliases[output.second.get_value<std::string>()] =
+                to.find(output.first)->second.get_value<std::string>();
+        }
+
+        return true;
+    }
+
+    void rebindInputs(boost::property_tree::ptree& entry) {
+        auto inputs = entry.find("inputs");
+        if (inputs == entry.not_found()) {
+            return;
+        }
+
+        for (auto& input : inputs->second) {
+            input.second.put_value(
+                    resolveAlias(input.second.get_value<std::string>()));
+        }
+    }
+
+    std::string resolveAlias(std::string globalName) const {
+        for (auto it = aliases.find(globalName); it != aliases.end();
+                it = aliases.find(globalName)) {
+            globalName = it->second;
+        }
+
+        return globalName;
+    }
+
+    // Marking one copy "deterministic" vouches for all of them, so the
+    // flag itself is left out.
+    static std::string moduleSignature(
+            const boost::property_tree::ptree& entry) {
+        boost::property_tree::ptree signature(entry);
+        signature.erase("id");
+        signature.erase("outputs");
+        signature.erase("deterministic");
+
+        return fingerprint(signature);
+    }
+
+    // Adds a vertex for each plan entry and records where outputs go.
+    void recordOutputs(
             const boost::property_tree::ptree& config,
             G& dependencies,
             std::map<std::string, OutputInfo>& outputInfos,
-            std::map<Vertex, const std::vector<ArgInfo>*>& argInfos,
-            C... c) {
+            std::vector<const Factory*>& factories) {
         for (auto& it : config) {
             const std::string& id = it.second.get<std::string>("id");
             auto factory = getModuleFactoryRegistry<M, C...>().find(
@@ -277,10 +1417,8 @@ private:
 
             checkArguments(id, factory->info(), it.second);
 
-            Vertex m = boost::add_vertex(
-                    std::shared_ptr<M>(factory->create(id, c...)),
-                    dependencies);
-            argInfos[m] = &factory->info();
+            Vertex m = boost::add_vertex(id, dependencies);
+            factories.push_back(factory);
 
             auto outputs = it.second.find("outputs");
             if (outputs == it.second.not_found()) {
@@ -301,16 +1439,64 @@ private:
                                         localName))));
                 } else {
                     std::string msg = "module \"" +
-                        dependencies[old->second.module]->id() +
-                        "\" and module \"" + dependencies[m]->id() +
+                        dependencies[old->second.module] +
+                        "\" and module \"" + id +
                         "\" output to same global name: " +
                         globalName;
                     throw std::invalid_argument(msg);
                 }
             }
         }
+    }
 
-        num_outputs = outputInfos.size();
+    /*
+     * Runs the module constructors, concurrently if "options" ask for
+     * more than one thread because they may load large data.  Every
+     * constructor runs even if others throw, and all failures are
+     * reported in plan order by one ModuleConstructionError.
+     */
+    std::vector<std::shared_ptr<M>> createModules(
+            const BuildOptions& options,
+            const G& dependencies,
+            const std::vector<const Factory*>& factories,
+            C... c) {
+        size_t n = factories.size();
+        std::vector<std::shared_ptr<M>> modules(n);
+        std::vector<std::exception_ptr> errors(n);
+        auto create = [&](size_t i) {
+            try {
+                modules[i].reset(factories[i]->create(dependencies[i], c...));
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        };
+
+        size_t threads = options.threads > 0 ? options.threads :
+            std::thread::hardware_concurrency();
+        if (threads > 1 && n > 1) {
+            ThreadPool pool(std::min(threads, n));
+            for (size_t i = 0; i < n; ++i) {
+                pool.submit(std::bind(create, i));
+            }
+            pool.wait();
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                create(i);
+            }
+        }
+
+        ModuleConstructionError::Errors failed;
+        for (size_t i = 0; i < n; ++i) {
+            if (errors[i]) {
+                failed.push_back(std::make_pair(dependencies[i], errors[i]));
+            }
+        }
+
+        if (! failed.empty()) {
+            throw ModuleConstructionError(failed);
+        }
+
+        return modules;
     }
 
     void checkArguments(const std::string& id,
@@ -339,196 +1525,749 @@ private:
                     "\" has inconsistent outputs between config and code");
         }
 
-        for (auto& ai : info) {
-            auto inouts = ai.flag() == QP_IN ? inputs : outputs;
+        for (auto& ai : info) {
+            auto inouts = ai.flag() == QP_IN ? inputs : outputs;
+
+            if (inouts->second.find(ai.name()) == inouts->second.not_found()) {
+                auto msg = std::string("miss config for argument \"") +
+                    ai.name() + "\" of module \"" + id + '"';
+                throw std::invalid_argument(msg);
+            }
+        }
+    }
+
+    const ArgInfo& findArgInfo(const std::vector<ArgInfo>& info,
+            const std::string& name) {
+        for (auto& ai : info) {
+            if (name == ai.name()) {
+                return ai;
+            }
+        }
+
+        // checkArguments() assures "name" must exists in "info".
+        throw std::logic_error("shouldn't reach here");
+    }
+
+    void connectInputsOutputs(
+            const boost::property_tree::ptree& config,
+            G& dependencies,
+            const std::map<std::string, OutputInfo>& outputInfos,
+            const std::vector<const Factory*>& factories,
+            std::vector<Binding>& bindings,
+            const std::set<std::string>& callerOutputs) {
+        typename boost::graph_traits<G>::vertex_iterator v, v_end;
+        std::tie(v, v_end) = boost::vertices(dependencies);
+
+        std::map<std::string, int> readers = countReaders(config);
+
+        // the caller is one more reader of these
+        for (auto& name : callerOutputs) {
+            const std::string& globalName = resolveAlias(name);
+            if (outputInfos.find(globalName) == outputInfos.end()) {
+                throw std::invalid_argument("caller output \"" + name +
+                        "\" doesn't bind to any known output");
+            }
+            ++readers[globalName];
+        }
+        bindings.resize(boost::num_vertices(dependencies));
+
+        for (auto& it : config) {
+            const std::string& id = it.second.get<std::string>("id");
+
+            auto m = *v;
+            ++v;
+
+            auto inputs = it.second.find("inputs");
+            auto outputs = it.second.find("outputs");
+            std::map<std::string, int>& idx = bindings[m].slots;
+            std::set<std::string>& movables = bindings[m].movables;
+
+            if (outputs != it.second.not_found()) {
+                for (auto& output : outputs->second) {
+                    const std::string& localName = output.first;
+                    const std::string& globalName =
+                        output.second.get_value<std::string>();
+
+                    recordLocalNames(outputInfos, idx,
+                            localName, globalName);
+                    output_slots[m].push_back(idx[localName]);
+                }
+            }
+
+            if (inputs != it.second.not_found()) {
+                for (auto& input : inputs->second) {
+                    const std::string& localName = input.first;
+                    const std::string& globalName =
+                        input.second.get_value<std::string>();
+
+                    auto oi = outputInfos.find(globalName);
+                    if (oi == outputInfos.end()) {
+                        std::string msg = "input \"" + localName +
+                            "\" of module \"" + id +
+                            "\" has global name \"" + globalName +
+                            "\" that doesn't bind to any known output";
+
+                        throw std::invalid_argument(msg);
+                    }
+
+                    recordLocalNames(outputInfos, idx,
+                            localName, globalName);
+                    input_slots[m].push_back(idx[localName]);
+
+                    if (readers.at(globalName) == 1) {
+                        movables.insert(localName);
+                    }
+
+                    checkInputOutputType(id, localName,
+                            findArgInfo(factories[m]->info(), localName),
+                            oi->second.arginfo);
+
+                    auto upstream = oi->second.module;
+                    if (upstream == m) {
+                        throw std::invalid_argument(
+                                "self dependency found in module \"" +
+                                id + '"');
+                    }
+                    boost::add_edge(upstream, m, dependencies);
+                }
+            }
+        }
+    }
+
+    static std::map<std::string, int> countReaders(
+            const boost::property_tree::ptree& config) {
+        std::map<std::string, int> readers;
+
+        for (auto& it : config) {
+            auto inputs = it.second.find("inputs");
+            if (inputs == it.second.not_found()) {
+                continue;
+            }
+
+            for (auto& input : inputs->second) {
+                ++readers[input.second.get_value<std::string>()];
+            }
+        }
+
+        return readers;
+    }
+
+    void recordLocalNames(
+            const std::map<std::string, OutputInfo>& outputInfos,
+            std::map<std::string, int>& idx,
+            const std::string& localName,
+            const std::string& globalName) {
+        if (idx.find(localName) != idx.end()) {
+            // checkArguments() assures unique input/output names.
+            throw std::logic_error("shouldn't reach here");
+        }
+
+        idx[localName] = outputInfos.at(globalName).index;
+    }
+
+    void checkInputOutputType(const std::string& id,
+            const std::string& localName,
+            const ArgInfo& i1, const ArgInfo& i2) {
+        if (i1.typeinfo() != i2.typeinfo()) {
+            std::string msg = "input \"" + localName +
+                "\" of module \"" + id +
+                "\" has different data type with its upstream output:\n" +
+                "    internal type: " +
+                i1.typeinfo().name() + "\n\targ name: " +
+                i1.name() + "\n\targ type: " +
+                i1.type() + '\n' +
+                "    internal type: " +
+                i2.typeinfo().name() + "\n\targ name: " +
+                i2.name() + "\n\targ type: " +
+                i2.type();
+            throw std::invalid_argument(msg);
+        }
+    }
+
+    /*
+     * Peels off modules without downstream until none is left, otherwise
+     * reports what remains.  boost::remove_vertex() isn't used because it
+     * renumbers edges inside their std::set containers, which corrupts
+     * them on bigger graphs.
+     */
+    void checkCircularDependency(const G& deps) {
+        size_t n = boost::num_vertices(deps);
+        std::vector<bool> removed(n, false);
+        std::vector<size_t> degrees(n);
+        std::vector<std::vector<Vertex>> upstreams(n);
+        std::vector<Vertex> sinks;
+
+        for (size_t v = 0; v < n; ++v) {
+            degrees[v] = boost::out_degree(v, deps);
+            if (degrees[v] == 0) {
+                sinks.push_back(v);
+            }
+
+            typename boost::graph_traits<G>::adjacency_iterator a, a_end;
+            for (std::tie(a, a_end) = boost::adjacent_vertices(v, deps);
+                    a != a_end; ++a) {
+                upstreams[*a].push_back(v);
+            }
+        }
+
+        size_t left = n;
+        while (! sinks.empty()) {
+            Vertex v = sinks.back();
+            sinks.pop_back();
+            removed[v] = true;
+            --left;
+
+            for (auto u : upstreams[v]) {
+                if (--degrees[u] == 0) {
+                    sinks.push_back(u);
+                }
+            }
+        }
+
+        if (left > 0) {
+            std::ostringstream out;
+            out << "found circular dependency:\n";
+            writeGraphviz(out, remainingGraph(deps, removed));
+            throw std::invalid_argument(out.str());
+        }
+    }
+
+    static G remainingGraph(const G& deps, const std::vector<bool>& removed) {
+        G g;
+        std::map<Vertex, Vertex> vertices;
+
+        for (size_t v = 0; v < removed.size(); ++v) {
+            if (! removed[v]) {
+                vertices[v] = boost::add_vertex(deps[v], g);
+            }
+        }
+
+        for (auto& v : vertices) {
+            typename boost::graph_traits<G>::adjacency_iterator a, a_end;
+            for (std::tie(a, a_end) = boost::adjacent_vertices(v.first, deps);
+                    a != a_end; ++a) {
+                if (! removed[*a]) {
+                    boost::add_edge(v.second, vertices[*a], g);
+                }
+            }
+        }
+
+        return g;
+    }
+
+    int num_outputs;
+    int num_deduplicated;
+    std::map<std::string, std::string> aliases;
+    std::map<std::string, int> output_indexes;
+    std::vector<boost::property_tree::ptree> entries;
+    std::vector<std::vector<int>> input_slots;
+    std::vector<std::vector<int>> output_slots;
+    Graph graph;
+};
+
+
+/*
+ * Aggregates per module wall time, call count and output size over the
+ * last "window" queries of a planner, like EXPLAIN ANALYZE does for SQL.
+ * The critical path is the dependency chain with the largest sum of mean
+ * wall time.
+ */
+class QueryProfiler {
+public:
+    struct Sample {
+        bool called;
+        long long nanoseconds;
+        OutputBytes output_bytes;
+        size_t allocated_bytes;
+
+        Sample() : called(false), nanoseconds(0), allocated_bytes(0) {}
+    };
+
+    struct Stats {
+        size_t calls;
+        double mean_us;
+        double p50_us;
+        double p95_us;
+        double max_us;
+        double mean_output_bytes;
+        double mean_allocated_bytes;
+        size_t max_allocated_bytes;
+    };
+
+    template<typename M, typename... C>
+    QueryProfiler(const QueryPlan<M, C...>& plan, size_t window = 1000) :
+            queries(window), next(0), recorded(0) {
+        auto& g = plan.dependencies();
+        size_t n = boost::num_vertices(g);
+        ids.reserve(n);
+        downstreams.resize(n);
+        edge_slots.resize(n);
+
+        for (size_t v = 0; v < n; ++v) {
+            ids.push_back(g[v]->id());
+
+            auto& outputs = plan.outputSlots(v);
+            for (auto a = boost::adjacent_vertices(v, g);
+                    a.first != a.second; ++a.first) {
+                downstreams[v].push_back(*a.first);
+
+                // the outputs of "v" that the downstream module reads
+                std::vector<int> slots;
+                for (int slot : plan.inputSlots(*a.first)) {
+                    if (std::find(outputs.begin(), outputs.end(), slot) !=
+                            outputs.end()) {
+                        slots.push_back(slot);
+                    }
+                }
+                edge_slots[v].push_back(slots);
+            }
+        }
+    }
+
+    // "samples" is indexed by vertex in the plan graph.
+    void record(const std::vector<Sample>& samples) {
+        std::lock_guard<std::mutex> lock(m);
+
+        queries[next] = samples;
+        next = (next + 1) % queries.size();
+        if (recorded < queries.size()) {
+            ++recorded;
+        }
+    }
+
+    size_t numQueries() const {
+        std::lock_guard<std::mutex> lock(m);
+
+        return recorded;
+    }
+
+    std::vector<Stats> stats() const {
+        std::lock_guard<std::mutex> lock(m);
+
+        std::vector<Stats> result(ids.size());
+
+        for (size_t v = 0; v < ids.size(); ++v) {
+            std::vector<long long> times;
+            double bytes = 0, allocated = 0;
+            size_t max_allocated = 0;
+
+            for (size_t q = 0; q < recorded; ++q) {
+                auto& sample = queries[q][v];
+                if (sample.called) {
+                    times.push_back(sample.nanoseconds);
+                    for (auto& output : sample.output_bytes) {
+                        bytes += output.second;
+                    }
+                    allocated += sample.allocated_bytes;
+                    max_allocated = std::max(max_allocated,
+                            sample.allocated_bytes);
+                }
+            }
+
+            Stats& st = result[v];
+            st.calls = times.size();
+            st.mean_us = st.p50_us = st.p95_us = st.max_us = 0;
+            st.mean_output_bytes = st.mean_allocated_bytes = 0;
+            st.max_allocated_bytes = max_allocated;
+
+            if (times.empty()) {
+                continue;
+            }
+
+            std::sort(times.begin(), times.end());
+            double total = 0;
+            for (auto t : times) {
+                total += t;
+            }
+
+            st.mean_us = total / times.size() / 1000;
+            st.p50_us = percentile(times, 50) / 1000.0;
+            st.p95_us = percentile(times, 95) / 1000.0;
+            st.max_us = times.back() / 1000.0;
+            st.mean_output_bytes = bytes / times.size();
+            st.mean_allocated_bytes = allocated / times.size();
+        }
+
+        return result;
+    }
+
+    // Mean bytes passed along each edge, indexed like the downstream
+    // modules of each module.
+    std::vector<std::vector<double>> edgeBytes() const {
+        std::lock_guard<std::mutex> lock(m);
+
+        std::vector<std::vector<double>> result(ids.size());
+
+        for (size_t v = 0; v < ids.size(); ++v) {
+            result[v].assign(downstreams[v].size(), 0);
+            size_t calls = 0;
+
+            for (size_t q = 0; q < recorded; ++q) {
+                auto& sample = queries[q][v];
+                if (! sample.called) {
+                    continue;
+                }
+                ++calls;
+
+                for (size_t i = 0; i < edge_slots[v].size(); ++i) {
+                    for (auto& output : sample.output_bytes) {
+                        auto& slots = edge_slots[v][i];
+                        if (std::find(slots.begin(), slots.end(),
+                                    output.first) != slots.end()) {
+                            result[v][i] += output.second;
+                        }
+                    }
+                }
+            }
+
+            for (auto& bytes : result[v]) {
+                bytes = calls > 0 ? bytes / calls : 0;
+            }
+        }
+
+        return result;
+    }
+
+    std::vector<size_t> criticalPath(const std::vector<Stats>& st) const {
+        size_t n = ids.size();
+        std::vector<size_t> degrees(n, 0), order;
+        std::vector<double> costs(n, 0);
+        std::vector<size_t> previous(n, n);
+
+        for (auto& d : downstreams) {
+            for (auto v : d) {
+                ++degrees[v];
+            }
+        }
+
+        for (size_t v = 0; v < n; ++v) {
+            if (degrees[v] == 0) {
+                order.push_back(v);
+            }
+        }
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            size_t u = order[i];
+            costs[u] += st[u].mean_us;
+
+            for (auto v : downstreams[u]) {
+                if (costs[u] > costs[v] || previous[v] == n) {
+                    costs[v] = costs[u];
+                    previous[v] = u;
+                }
+
+                if (--degrees[v] == 0) {
+                    order.push_back(v);
+                }
+            }
+        }
+
+        std::vector<size_t> path;
+        if (n == 0) {
+            return path;
+        }
+
+        size_t last = std::max_element(costs.begin(), costs.end()) -
+            costs.begin();
+        for (size_t v = last; v != n; v = previous[v]) {
+            path.push_back(v);
+        }
+        std::reverse(path.begin(), path.end());
+
+        return path;
+    }
+
+    void writeGraphviz(std::ostream& out) const {
+        auto st = stats();
+        auto edges = edgeBytes();
+        auto path = criticalPath(st);
+        std::vector<bool> critical(ids.size(), false);
+        for (auto v : path) {
+            critical[v] = true;
+        }
+
+        out << "digraph G {\n";
 
-            if (inouts->second.find(ai.name()) == inouts->second.not_found()) {
-                auto msg = std::string("miss config for argument \"") +
-                    ai.name() + "\" of module \"" + id + '"';
-                throw std::invalid_argument(msg);
+        for (size_t v = 0; v < ids.size(); ++v) {
+            out << "  \"" << ids[v] << "\" [label=\"" << ids[v] <<
+                "\\ncalls=" << st[v].calls <<
+                " mean=" << st[v].mean_us << "us" <<
+                " p95=" << st[v].p95_us << "us" <<
+                "\\nout=" << st[v].mean_output_bytes << "B" <<
+                " alloc=" << st[v].mean_allocated_bytes << "B\"" <<
+                (critical[v] ? ", color=red, penwidth=2" : "") << "];\n";
+
+            for (size_t i = 0; i < downstreams[v].size(); ++i) {
+                size_t a = downstreams[v][i];
+                bool onPath = false;
+                for (size_t i = 0; i + 1 < path.size(); ++i) {
+                    if (path[i] == v && path[i + 1] == a) {
+                        onPath = true;
+                    }
+                }
+
+                out << "\t\t\"" << ids[v] << "\" -> \"" << ids[a] <<
+                    "\" [label=\"" << edges[v][i] << "B\"" <<
+                    (onPath ? ", color=red, penwidth=2" : "") << "];\n";
             }
         }
+
+        out << "}\n";
     }
 
-    const ArgInfo& findArgInfo(const std::vector<ArgInfo>& info,
-            const std::string& name) {
-        for (auto& ai : info) {
-            if (name == ai.name()) {
-                return ai;
+    void writeJson(std::ostream& out) const {
+        auto st = stats();
+        auto edges = edgeBytes();
+        auto path = criticalPath(st);
+        double total = 0;
+        for (auto v : path) {
+            total += st[v].mean_us;
+        }
+
+        out << "{\n  \"queries\": " << numQueries() <<
+            ",\n  \"critical_path_us\": " << total <<
+            ",\n  \"critical_path\": [";
+        for (size_t i = 0; i < path.size(); ++i) {
+            out << (i > 0 ? ", " : "") << jsonString(ids[path[i]]);
+        }
+        out << "],\n  \"modules\": [";
+
+        for (size_t v = 0; v < ids.size(); ++v) {
+            out << (v > 0 ? "," : "") << "\n    {\"id\": " <<
+                jsonString(ids[v]) <<
+                ", \"calls\": " << st[v].calls <<
+                ", \"mean_us\": " << st[v].mean_us <<
+                ", \"p50_us\": " << st[v].p50_us <<
+                ", \"p95_us\": " << st[v].p95_us <<
+                ", \"max_us\": " << st[v].max_us <<
+                ", \"mean_output_bytes\": " << st[v].mean_output_bytes <<
+                ", \"mean_allocated_bytes\": " <<
+                st[v].mean_allocated_bytes <<
+                ", \"max_allocated_bytes\": " << st[v].max_allocated_bytes <<
+                ", \"downstream\": [";
+            for (size_t i = 0; i < downstreams[v].size(); ++i) {
+                out << (i > 0 ? ", " : "") <<
+                    jsonString(ids[downstreams[v][i]]);
             }
+            out << "], \"downstream_bytes\": [";
+            for (size_t i = 0; i < edges[v].size(); ++i) {
+                out << (i > 0 ? ", " : "") << edges[v][i];
+            }
+            out << "]}";
         }
 
-        // checkArguments() assures "name" must exists in "info".
-        throw std::logic_error("shouldn't reach here");
+        out << "\n  ]\n}\n";
     }
 
-    void connectInputsOutputs(
-            const boost::property_tree::ptree& config,
-            G& dependencies,
-            const std::map<std::string, OutputInfo>& outputInfos,
-            const std::map<Vertex, const std::vector<ArgInfo>*>& argInfos) {
-        typename boost::graph_traits<G>::vertex_iterator v, v_end;
-        std::tie(v, v_end) = boost::vertices(dependencies);
-
-        for (auto& it : config) {
-            const std::string& id = it.second.get<std::string>("id");
+private:
+    // nearest rank of sorted samples
+    static long long percentile(const std::vector<long long>& sorted,
+                                size_t p) {
+        size_t rank = (sorted.size() * p + 99) / 100;
+        return sorted[rank > 0 ? rank - 1 : 0];
+    }
 
-            auto m = *v;
-            ++v;
+    static std::string jsonString(const std::string& s) {
+        std::string r = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                r += '\\';
+            }
+            r += c;
+        }
 
-            auto inputs = it.second.find("inputs");
-            auto outputs = it.second.find("outputs");
-            std::map<std::string, int> idx;
+        return r + '"';
+    }
 
-            if (outputs != it.second.not_found()) {
-                for (auto& output : outputs->second) {
-                    const std::string& localName = output.first;
-                    const std::string& globalName =
-                        output.second.get_value<std::string>();
+    std::vector<std::string> ids;
+    std::vector<std::vector<size_t>> downstreams;
+    std::vector<std::vector<std::vector<int>>> edge_slots;
+    std::vector<std::vector<Sample>> queries;
+    size_t next;
+    size_t recorded;
+    mutable std::mutex m;
+};
 
-                    recordLocalNames(outputInfos, idx,
-                            localName, globalName);
-                }
-            }
 
-            if (inputs != it.second.not_found()) {
-                for (auto& input : inputs->second) {
-                    const std::string& localName = input.first;
-                    const std::string& globalName =
-                        input.second.get_value<std::string>();
+template<size_t... I>
+struct Indexes {};
 
-                    auto oi = outputInfos.find(globalName);
-                    if (oi == outputInfos.end()) {
-                        std::string msg = "input \"" + localName +
-                            "\" of module \"" + id +
-                            "\" has global name \"" + globalName +
-                            "\" that doesn't bind to any known output";
+template<size_t N, size_t... I>
+struct MakeIndexes : MakeIndexes<N - 1, N - 1, I...> {};
 
-                        throw std::invalid_argument(msg);
-                    }
+template<size_t... I>
+struct MakeIndexes<0, I...> {
+    typedef Indexes<I...> type;
+};
 
-                    recordLocalNames(outputInfos, idx,
-                            localName, globalName);
 
-                    checkInputOutputType(id, localName,
-                            findArgInfo(*argInfos.at(m), localName),
-                            oi->second.arginfo);
+// Runs one module, and measures it when a sample is asked for.  Modules
+// of a query past its memory budget are skipped or throw, by policy.
+template<typename M, typename... A>
+ModuleStatus invokeModule(M& module, const ContextPtr& ctx, Context& out,
+                          QueryProfiler::Sample* sample, A... a) {
+    MemoryBudget* budget = ctx->memoryBudget();
+    if (budget && budget->exhausted()) {
+        if (budget->policy() == MemoryBudget::Policy::Abort) {
+            throw MemoryBudgetExceeded();
+        }
+        return ModuleStatus::Skipped;
+    }
 
-                    auto upstream = oi->second.module;
-                    if (upstream == m) {
-                        throw std::invalid_argument(
-                                "self dependency found in module \"" +
-                                dependencies[m]->id() + '"');
-                    }
-                    boost::add_edge(upstream, m, dependencies);
-                }
-            }
+    MemoryAccount account(budget);
+    bool ok;
 
-            dependencies[m]->resolve(idx);
+    if (sample) {
+        auto t0 = std::chrono::steady_clock::now();
+        {
+            MemoryAccount::Scope scope(&account);
+            ok = module(ctx, out, a...);
         }
+        auto t1 = std::chrono::steady_clock::now();
+
+        sample->called = true;
+        sample->nanoseconds = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(t1 - t0).count();
+        sample->output_bytes.clear();
+        module.outputBytes(out, sample->output_bytes);
+        sample->allocated_bytes = account.allocated;
+    } else {
+        MemoryAccount::Scope scope(&account);
+        ok = module(ctx, out, a...);
     }
 
-    void recordLocalNames(
-            const std::map<std::string, OutputInfo>& outputInfos,
-            std::map<std::string, int>& idx,
-            const std::string& localName,
-            const std::string& globalName) {
-        if (idx.find(localName) != idx.end()) {
-            // checkArguments() assures unique input/output names.
-            throw std::logic_error("shouldn't reach here");
-        }
+    return ok ? ModuleStatus::Succeeded : ModuleStatus::Failed;
+}
 
-        idx[localName] = outputInfos.at(globalName).index;
-    }
 
-    void checkInputOutputType(const std::string& id,
-            const std::string& localName,
-            const ArgInfo& i1, const ArgInfo& i2) {
-        if (i1.typeinfo() != i2.typeinfo()) {
-            std::string msg = "input \"" + localName +
-                "\" of module \"" + id +
-                "\" has different data type with its upstream output:\n" +
-                "    internal type: " +
-                i1.typeinfo().name() + "\n\targ name: " +
-                i1.name() + "\n\targ type: " +
-                i1.type() + '\n' +
-                "    internal type: " +
-                i2.typeinfo().name() + "\n\targ name: " +
-                i2.name() + "\n\targ type: " +
-                i2.type();
-            throw std::invalid_argument(msg);
-        }
+/*
+ * What the planners below share: running a query on a fresh context, and
+ * the profiler and memory budget settings.  The planner "P" provides
+ * run(ContextPtr, A...).
+ */
+template<typename P>
+class QueryPlannerBase
+{
+public:
+    // Returns status of each module, indexed by vertex in the plan graph.
+    template<typename... A>
+    std::vector<ModuleStatus> operator()(A... a) {
+        return static_cast<P&>(*this).run(std::make_shared<Context>(), a...);
     }
 
-    void checkCircularDependency(G deps) {
-        while (boost::num_vertices(deps) > 0) {
-            bool found = false;
+    void setProfiler(std::shared_ptr<QueryProfiler> p) {
+        profiler = p;
+    }
 
-            typename boost::graph_traits<G>::vertex_iterator v, v_end;
-            for (std::tie(v, v_end) = vertices(deps); v != v_end; ++v) {
-                if (out_degree(*v, deps) == 0) {
-                    found = true;
-                    clear_vertex(*v, deps);
-                    remove_vertex(*v, deps);
-                    break;
-                }
-            }
+    // Each query may hold "bytes" of module allocations, see MemoryBudget.
+    void setMemoryBudget(size_t bytes, MemoryBudget::Policy policy) {
+        memory_limit.bytes = bytes;
+        memory_limit.policy = policy;
+    }
 
-            if (! found) {
-                std::ostringstream out;
-                out << "found circular dependency:\n";
-                writeGraphviz(out, deps);
-                throw std::invalid_argument(out.str());
-            }
-        }
+protected:
+    // Makes room for "outputs" in "ctx", under the query memory budget.
+    void prepare(Context& ctx, size_t outputs) const {
+        ctx.resize(outputs);
+        memory_limit.apply(ctx);
     }
 
-    int num_outputs;
-    Graph graph;
+    std::shared_ptr<QueryProfiler> profiler;
+    MemoryLimit memory_limit;
 };
 
 
 template<typename M, typename... C>
-class SingleThreadBlockedQueryPlanner
+class SingleThreadBlockedQueryPlanner :
+        public QueryPlannerBase<SingleThreadBlockedQueryPlanner<M, C...>>
 {
 public:
     SingleThreadBlockedQueryPlanner(
-            const boost::property_tree::ptree& config, C... c) {
-        QueryPlan<M, C...> plan(config, c...);
+            const boost::property_tree::ptree& config, C... c) :
+                SingleThreadBlockedQueryPlanner(BuildOptions(), config, c...) {
+    }
+
+    SingleThreadBlockedQueryPlanner(const BuildOptions& options,
+            const boost::property_tree::ptree& config, C... c) :
+                SingleThreadBlockedQueryPlanner(
+                    QueryPlan<M, C...>(options, config, c...)) {
+    }
 
+    SingleThreadBlockedQueryPlanner(const QueryPlan<M, C...>& plan) {
         num_outputs = plan.numOutputs();
-        G& g = plan.dependencies();
+        const G& g = plan.dependencies();
 
         std::vector<Vertex> v;
         boost::topological_sort(g, std::back_inserter(v));
 
         modules.reserve(v.size());
+        vertices.reserve(v.size());
+        upstreams.resize(v.size());
 
         for (auto it = v.rbegin(); it != v.rend(); ++it) {
             modules.push_back(g[*it]);
+            vertices.push_back(*it);
+
+            for (auto u = boost::inv_adjacent_vertices(*it, g);
+                    u.first != u.second; ++u.first) {
+                upstreams[*it].push_back(*u.first);
+            }
         }
     }
 
+    // Like operator(), leaving module outputs in "ctx", except inputs moved
+    // out by their sole reader, see BuildOptions::outputs.
     template<typename... A>
-    void operator()(A... a) {
-        auto ctx = std::make_shared<Context>(num_outputs);
+    std::vector<ModuleStatus> run(ContextPtr ctx, A... a) {
+        prepare(*ctx, num_outputs);
+        std::vector<ModuleStatus> statuses(modules.size(),
+                ModuleStatus::Skipped);
+        std::vector<QueryProfiler::Sample> samples(
+                profiler ? modules.size() : 0);
+
+        for (size_t i = 0; i < modules.size(); ++i) {
+            Vertex v = vertices[i];
+            bool ready = true;
+
+            for (auto u : upstreams[v]) {
+                if (statuses[u] != ModuleStatus::Succeeded) {
+                    ready = false;
+                    break;
+                }
+            }
+
+            if (ready) {
+                statuses[v] = invokeModule(*modules[i], ctx, *ctx,
+                        profiler ? &samples[v] : nullptr, a...);
+            }
+        }
 
-        for (auto& m : modules) {
-            (*m)(ctx, a...);
+        if (profiler) {
+            profiler->record(samples);
         }
+
+        return statuses;
     }
 
 private:
+    typedef QueryPlannerBase<SingleThreadBlockedQueryPlanner<M, C...>> Base;
     typedef typename QueryPlan<M, C...>::Graph G;
     typedef typename G::vertex_descriptor Vertex;
 
+    using Base::prepare;
+    using Base::profiler;
+
     int num_outputs;
     std::vector<std::shared_ptr<M>> modules;
+    std::vector<Vertex> vertices;
+    std::vector<std::vector<Vertex>> upstreams;
 };
 
 
 template<typename M, typename... C>
-class SignalBasedSingleThreadBlockedQueryPlanner
+class SignalBasedSingleThreadBlockedQueryPlanner :
+        public QueryPlannerBase<
+            SignalBasedSingleThreadBlockedQueryPlanner<M, C...>>
 {
 public:
     SignalBasedSingleThreadBlockedQueryPlanner(
@@ -536,17 +2275,33 @@ public:
                 plan(config, c...) {
     }
 
+    SignalBasedSingleThreadBlockedQueryPlanner(const BuildOptions& options,
+            const boost::property_tree::ptree& config, C... c) :
+                plan(options, config, c...) {
+    }
+
+    SignalBasedSingleThreadBlockedQueryPlanner(
+            const QueryPlan<M, C...>& plan) : plan(plan) {
+    }
+
+    // Like operator(), leaving module outputs in "ctx", except inputs moved
+    // out by their sole reader, see BuildOptions::outputs.
     template<typename... A>
-    void operator()(A... a) {
-        ContextPtr ctx = std::make_shared<Context>(plan.numOutputs());
+    std::vector<ModuleStatus> run(ContextPtr ctx, A... a) {
+        prepare(*ctx, plan.numOutputs());
 
         auto& g = plan.dependencies();
+        std::vector<ModuleStatus> statuses(boost::num_vertices(g),
+                ModuleStatus::Skipped);
+        std::vector<QueryProfiler::Sample> samples(
+                profiler ? boost::num_vertices(g) : 0);
         boost::signals2::signal<void(ContextPtr, A...)> sig;
         std::map<Vertex, std::shared_ptr<Signal<A...>>> signals;
 
         for (auto it = boost::vertices(g); it.first != it.second; ++it.first) {
             signals[*it.first] = std::make_shared<Signal<A...>>(
-                    g[*it.first], boost::in_degree(*it.first, g));
+                    g, *it.first, statuses,
+                    profiler ? &samples[*it.first] : nullptr);
         }
 
         for (auto it = boost::vertices(g); it.first != it.second; ++it.first) {
@@ -563,26 +2318,43 @@ public:
         }
 
         sig(ctx, a...);
+
+        if (profiler) {
+            profiler->record(samples);
+        }
+
+        return statuses;
     }
 
 private:
+    typedef QueryPlannerBase<
+        SignalBasedSingleThreadBlockedQueryPlanner<M, C...>> Base;
     typedef typename QueryPlan<M, C...>::Graph G;
     typedef typename G::vertex_descriptor Vertex;
 
+    using Base::prepare;
+    using Base::profiler;
+
     template<typename... A> class Slot;
 
     template<typename... A>
     class Signal {
     public:
-        Signal(std::shared_ptr<M> m, int i) : module(m), in_degree(i) {}
-
+        Signal(const G& g, Vertex v, std::vector<ModuleStatus>& s,
+               QueryProfiler::Sample* p) :
+            graph(g), vertex(v), statuses(s), sample(p),
+            in_degree(boost::in_degree(v, g)) {}
+
+        /*
+         * Downstream is signaled even if this module failed or was
+         * skipped, so that every module gets its final status; a module
+         * that throws leaves its dependents alone.
+         */
         void operator()(ContextPtr ctx, A... a) {
             if (--in_degree <= 0) {
-                try {
-                    (*module)(ctx, a...);
-                } catch (...) {
-                    sig(ctx, a...);
-                    throw;
+                if (upstreamsSucceeded()) {
+                    statuses[vertex] = invokeModule(*graph[vertex], ctx,
+                            *ctx, sample, a...);
                 }
 
                 sig(ctx, a...);
@@ -594,7 +2366,21 @@ private:
         }
 
     private:
-        std::shared_ptr<M> module;
+        bool upstreamsSucceeded() const {
+            for (auto u = boost::inv_adjacent_vertices(vertex, graph);
+                    u.first != u.second; ++u.first) {
+                if (statuses[*u.first] != ModuleStatus::Succeeded) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        const G& graph;
+        Vertex vertex;
+        std::vector<ModuleStatus>& statuses;
+        QueryProfiler::Sample* sample;
         std::atomic_int in_degree;
         boost::signals2::signal<void(ContextPtr, A...)> sig;
     };
@@ -616,6 +2402,211 @@ private:
 };
 
 
+/*
+ * Re-evaluates a plan for successive calls whose arguments change little.
+ * The context of the previous call is kept, and a module runs again only
+ * if a caller argument it reads changed, an upstream module's outputs or
+ * status changed, or it didn't succeed last time.  Plan entries list the
+ * positions of caller arguments they read in "arguments", all of them by
+ * default.  Arguments and outputs are compared with ==, values that can't
+ * be compared are always considered changed.
+ *
+ * Inputs are never moved out of the kept context, and the context is
+ * rebuilt by a full evaluation once reruns have grown its arena to four
+ * times its size after the last full evaluation.
+ */
+template<typename M, typename... C>
+class IncrementalSession
+{
+public:
+    IncrementalSession(const QueryPlan<M, C...>& plan) :
+            num_outputs(plan.numOutputs()), baseline(0) {
+        const G& g = plan.dependencies();
+        std::vector<Vertex> v;
+        boost::topological_sort(g, std::back_inserter(v));
+
+        modules.resize(v.size());
+        upstreams.resize(v.size());
+        output_slots.resize(v.size());
+        arguments.resize(v.size());
+
+        for (auto it = v.rbegin(); it != v.rend(); ++it) {
+            order.push_back(*it);
+            modules[*it] = g[*it];
+            output_slots[*it] = plan.outputSlots(*it);
+
+            for (auto u = boost::inv_adjacent_vertices(*it, g);
+                    u.first != u.second; ++u.first) {
+                upstreams[*it].push_back(*u.first);
+            }
+
+            auto args = plan.settings(*it).find("arguments");
+            if (args == plan.settings(*it).not_found()) {
+                arguments[*it].push_back(-1);
+                continue;
+            }
+
+            for (auto& arg : args->second) {
+                int i = arg.second.template get_value<int>();
+                if (i < 0 || size_t(i) >= M::numArguments) {
+                    throw std::invalid_argument("module \"" +
+                            modules[*it]->id() + "\" reads argument " +
+                            std::to_string(i) + " of " +
+                            std::to_string(M::numArguments));
+                }
+                arguments[*it].push_back(i);
+            }
+        }
+    }
+
+    // Returns status of each module, indexed by vertex in the plan graph.
+    template<typename... A>
+    std::vector<ModuleStatus> operator()(A... a) {
+        std::vector<bool> changed_args(sizeof...(A), true);
+        rememberArguments(changed_args, 0, a...);
+
+        bool full = ! ctx;
+        if (full) {
+            ctx = std::make_shared<Context>(num_outputs);
+            ctx->setMovable(false);
+            statuses.assign(modules.size(), ModuleStatus::Skipped);
+        }
+
+        std::vector<bool> changed(modules.size(), false);
+        evaluated.clear();
+
+        try {
+            // previous outputs, in ctx's arena so gone before ctx may go
+            Context old(num_outputs);
+
+            for (auto v : order) {
+                if (! full && ! dirty(v, changed_args, changed)) {
+                    continue;
+                }
+
+                ModuleStatus status = ModuleStatus::Skipped;
+                bool ready = true;
+                for (auto u : upstreams[v]) {
+                    ready = ready && statuses[u] == ModuleStatus::Succeeded;
+                }
+
+                if (ready) {
+                    // keep the previous outputs to compare against
+                    for (int i : output_slots[v]) {
+                        old[i] = std::move(ctx->at(i));
+                    }
+
+                    status = invokeModule(*modules[v], ctx, *ctx, nullptr,
+                            a...);
+                    evaluated.push_back(v);
+                }
+
+                changed[v] = full || status != statuses[v] ||
+                    (status == ModuleStatus::Succeeded &&
+                     ! modules[v]->outputsEqual(old, *ctx));
+                statuses[v] = status;
+            }
+        } catch (...) {
+            ctx.reset();
+            throw;
+        }
+
+        size_t bytes = ctx->arena().bytesAllocated();
+        if (full) {
+            baseline = bytes;
+        } else if (bytes > 4 * baseline + QP_ARENA_BLOCK_SIZE) {
+            ctx.reset();
+        }
+
+        return statuses;
+    }
+
+    // Outputs of the last call, null before the first call and after a
+    // call that threw.
+    ContextPtr context() const {
+        return ctx;
+    }
+
+    // Vertices of the modules the last call ran, in the order they ran.
+    const std::vector<size_t>& lastEvaluated() const {
+        return evaluated;
+    }
+
+private:
+    typedef typename QueryPlan<M, C...>::Graph G;
+    typedef typename G::vertex_descriptor Vertex;
+
+    bool dirty(Vertex v, const std::vector<bool>& changed_args,
+               const std::vector<bool>& changed) const {
+        if (statuses[v] != ModuleStatus::Succeeded) {
+            return true;
+        }
+
+        for (int i : arguments[v]) {
+            if (i < 0) {
+                if (std::find(changed_args.begin(), changed_args.end(),
+                            true) != changed_args.end()) {
+                    return true;
+                }
+            } else if (changed_args[i]) {
+                return true;
+            }
+        }
+
+        for (auto u : upstreams[v]) {
+            if (changed[u]) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void rememberArguments(std::vector<bool>&, size_t) {}
+
+    template<typename T, typename... Rest>
+    void rememberArguments(std::vector<bool>& changed, size_t i,
+                           const T& v, const Rest&... rest) {
+        if (previous.size() <= i) {
+            previous.resize(i + 1);
+        }
+        changed[i] = remember(previous[i], v);
+
+        rememberArguments(changed, i + 1, rest...);
+    }
+
+    template<typename T>
+    static typename std::enable_if<IsComparable<T>::value, bool>::type
+    remember(boost::any& slot, const T& v) {
+        auto p = boost::any_cast<T>(&slot);
+        if (p && *p == v) {
+            return false;
+        }
+
+        slot = v;
+        return true;
+    }
+
+    template<typename T>
+    static typename std::enable_if<! IsComparable<T>::value, bool>::type
+    remember(boost::any&, const T&) {
+        return true;
+    }
+
+    int num_outputs;
+    std::vector<std::shared_ptr<M>> modules;
+    std::vector<Vertex> order;
+    std::vector<std::vector<Vertex>> upstreams;
+    std::vector<std::vector<int>> output_slots;
+    std::vector<std::vector<int>> arguments;    // -1 for all of them
+
+    ContextPtr ctx;
+    std::vector<ModuleStatus> statuses;
+    std::vector<boost::any> previous;
+    std::vector<size_t> evaluated;
+    size_t baseline;
+};
+
 
 #define QP_MODULE(module, name, functorType, args,          \
                   extra_args, ...)                          \
@@ -629,21 +2620,27 @@ private:
     class module : public queryplan::Module<A...> {         \
     public:                                                 \
         typedef typename queryplan::Module<A...> Base;      \
+        using Base::resolve;                                \
+        using Base::operator();                             \
         template<typename... C>                             \
         module(const std::string& id,                       \
              C... c) :                                      \
-            id_(id), func_(c...) {}                         \
+            id_(id), func_(queryplan::FunctorCache<         \
+                functorType>::get(c...)) {}                 \
         QP_DECLARE_RESOLVE(args)                            \
         QP_DECLARE_RUN(module, args)                        \
         QP_DECLARE_MODULE_INFO(args)                        \
+        QP_DECLARE_OUTPUT_BYTES(args)                       \
+        QP_DECLARE_OUTPUTS_EQUAL(args)                      \
         const std::string& id() const {                     \
             return id_;                                     \
         }                                                   \
-        functorType& functor()                              \
-            const { return func_; }                         \
+        functorType& functor() { return *func_; }           \
+        const functorType& functor()                        \
+            const { return *func_; }                        \
     private:                                                \
         const std::string id_;                              \
-        functorType func_;                                  \
+        const std::shared_ptr<functorType> func_;           \
         QP_DECLARE_INDEXES(args)                            \
     }
 
@@ -659,6 +2656,72 @@ private:
 
 
 
+// Lets modules constructed from equal arguments share one functor, which
+// must then be read-only or thread safe.  Use it at global scope.
+#define QP_SHARE_FUNCTOR(functorType)                       \
+    namespace queryplan {                                   \
+        template<>                                          \
+        struct IsSharedFunctor<functorType> :               \
+            std::true_type {};                              \
+    }
+
+
+
+// Counts heap allocations made by modules, see MemoryAccount.  Expand it
+// once at global scope in a program.
+#define QP_DEFINE_MEMORY_HOOKS()                            \
+    void* operator new(std::size_t n) {                     \
+        return queryplan::allocateCounted(n);               \
+    }                                                       \
+    void* operator new[](std::size_t n) {                   \
+        return queryplan::allocateCounted(n);               \
+    }                                                       \
+    void* operator new(std::size_t n,                       \
+            const std::nothrow_t&) noexcept {               \
+        try {                                               \
+            return queryplan::allocateCounted(n);           \
+        } catch (...) {                                     \
+            return nullptr;                                 \
+        }                                                   \
+    }                                                       \
+    void* operator new[](std::size_t n,                     \
+            const std::nothrow_t&) noexcept {               \
+        try {                                               \
+            return queryplan::allocateCounted(n);           \
+        } catch (...) {                                     \
+            return nullptr;                                 \
+        }                                                   \
+    }                                                       \
+    void operator delete(void* p) noexcept {                \
+        queryplan::deallocateCounted(p);                    \
+    }                                                       \
+    void operator delete[](void* p) noexcept {              \
+        queryplan::deallocateCounted(p);                    \
+    }                                                       \
+    void operator delete(void* p,                           \
+            const std::nothrow_t&) noexcept {               \
+        queryplan::deallocateCounted(p);                    \
+    }                                                       \
+    void operator delete[](void* p,                         \
+            const std::nothrow_t&) noexcept {               \
+        queryplan::deallocateCounted(p);                    \
+    }                                                       \
+    QP_DEFINE_SIZED_DELETE_HOOKS()
+
+#ifdef __cpp_sized_deallocation
+#define QP_DEFINE_SIZED_DELETE_HOOKS()                      \
+    void operator delete(void* p, std::size_t) noexcept {   \
+        queryplan::deallocateCounted(p);                    \
+    }                                                       \
+    void operator delete[](void* p, std::size_t) noexcept { \
+        queryplan::deallocateCounted(p);                    \
+    }
+#else
+#define QP_DEFINE_SIZED_DELETE_HOOKS()
+#endif
+
+
+
 #define QP_DECLARE_MODULE_INFO(args)        \
     static const                                            \
         std::vector<queryplan::ArgInfo>& info() {           \
@@ -682,40 +2745,93 @@ private:
 
 
 
+#define QP_DECLARE_OUTPUT_BYTES(args)       \
+    void outputBytes(const queryplan::Context& ctx,                 \
+                     queryplan::OutputBytes& bytes) const {         \
+        using queryplan::byteSize;                                  \
+        BOOST_PP_SEQ_FOR_EACH(QP_ADD_OUTPUT_BYTES, 0, args)         \
+    }
+
+#define QP_ADD_OUTPUT_BYTES(r, data, arg)   \
+    BOOST_PP_EXPR_IF(BOOST_PP_EQUAL(QP_ARG_FLAG(arg), QP_OUT),      \
+        if (auto p = boost::any_cast<typename std::remove_reference<  \
+                    QP_ARG_TYPE(arg)>::type>(                       \
+                        &ctx.at(QP_INDEX_NAME(arg)))) {             \
+            bytes.push_back(std::make_pair(QP_INDEX_NAME(arg),      \
+                                           byteSize(*p)));          \
+        })
+
+
+
+#define QP_DECLARE_OUTPUTS_EQUAL(args)      \
+    bool outputsEqual(const queryplan::Context& a,                  \
+                      const queryplan::Context& b) const {          \
+        BOOST_PP_SEQ_FOR_EACH(QP_COMPARE_OUTPUT, 0, args)           \
+        return true;                                                \
+    }
+
+#define QP_COMPARE_OUTPUT(r, data, arg)     \
+    BOOST_PP_EXPR_IF(BOOST_PP_EQUAL(QP_ARG_FLAG(arg), QP_OUT),      \
+        if (! queryplan::anyEqual<typename std::remove_reference<   \
+                    QP_ARG_TYPE(arg)>::type>(                       \
+                        a.at(QP_INDEX_NAME(arg)),                   \
+                        b.at(QP_INDEX_NAME(arg)))) {                \
+            return false;                                           \
+        })
+
+
+
 #define QP_DECLARE_RESOLVE(args)            \
-    void resolve(const std::map<std::string, int>& m) {     \
+    void resolve(const std::map<std::string, int>& m,       \
+                 const std::set<std::string>& movables) {   \
         BOOST_PP_SEQ_FOR_EACH(QP_ASSIGN_INDEX, 0, args)     \
     }
 
 #define QP_ASSIGN_INDEX(r, data, arg)       \
-    QP_INDEX_NAME(arg) = m.at(BOOST_PP_STRINGIZE(QP_ARG_NAME(arg)));
+    QP_INDEX_NAME(arg) = m.at(BOOST_PP_STRINGIZE(QP_ARG_NAME(arg)));    \
+    QP_MOVE_NAME(arg) = movables.count(                                 \
+            BOOST_PP_STRINGIZE(QP_ARG_NAME(arg))) > 0;
 
 
 
 #define QP_DECLARE_RUN(module, args)        \
-    void operator()(queryplan::ContextPtr ctx, A... a) {            \
+    bool operator()(queryplan::ContextPtr ctx,                      \
+                    queryplan::Context& out, A... a) {              \
+        queryplan::Arena::Scope arena_scope(ctx->arena());          \
         BOOST_PP_SEQ_FOR_EACH(QP_ASSIGN_VALUE, 0, args)             \
         BOOST_PP_EXPR_IF(                                           \
             QP_ENABLE_TRACE, QP_TRACE(module, args, ">"))           \
         BOOST_PP_EXPR_IF(                                           \
             QP_ENABLE_TIMING, QP_BEGIN_TIMING())                    \
-        func_(BOOST_PP_SEQ_ENUM(                                    \
-            BOOST_PP_SEQ_TRANSFORM(QP_TRANS_TYPE_NAME, 0, args)),   \
-              a...);                                                \
+        bool ok = queryplan::invokeFunctor(*func_,                  \
+            BOOST_PP_SEQ_ENUM(BOOST_PP_SEQ_TRANSFORM(               \
+                    QP_TRANS_TYPE_NAME, 0, args)),                  \
+            a...);                                                  \
         BOOST_PP_EXPR_IF(                                           \
             QP_ENABLE_TIMING, QP_END_TIMING(module))                \
         BOOST_PP_EXPR_IF(                                           \
             QP_ENABLE_TRACE, QP_TRACE(module, args, "<"))           \
+        return ok;                                                  \
     }
 
 #define QP_ASSIGN_VALUE(r, data, arg)       \
-    boost::any& QP_ANY_NAME(arg) = ctx->at(QP_INDEX_NAME(arg));     \
+    boost::any& QP_ANY_NAME(arg) = BOOST_PP_IF(                     \
+            BOOST_PP_EQUAL(QP_ARG_FLAG(arg), QP_OUT), out, (*ctx))  \
+        .at(QP_INDEX_NAME(arg));                                    \
     BOOST_PP_EXPR_IF(BOOST_PP_EQUAL(QP_ARG_FLAG(arg), QP_OUT),      \
             QP_ANY_NAME(arg) = QP_ARG_VALUE(arg);)
 
 #define QP_TRANS_TYPE_NAME(s, data, arg)    \
+    BOOST_PP_IF(BOOST_PP_EQUAL(QP_ARG_FLAG(arg), QP_OUT),           \
+            QP_OUTPUT_VALUE, QP_INPUT_VALUE)(arg)
+
+#define QP_OUTPUT_VALUE(arg)                \
     boost::any_cast<QP_ARG_TYPE(arg)>(QP_ANY_NAME(arg))
 
+#define QP_INPUT_VALUE(arg)                 \
+    queryplan::inputValue<QP_ARG_TYPE(arg)>(QP_ANY_NAME(arg),       \
+            QP_MOVE_NAME(arg) && &out == ctx.get() && ctx->movable())
+
 #define QP_ANY_NAME(arg)                    \
     BOOST_PP_SEQ_CAT((QP_ARG_NAME(arg)) (_any))
 
@@ -749,11 +2865,15 @@ private:
     BOOST_PP_SEQ_FOR_EACH(QP_DECLARE_INDEX, 0, args)
 
 #define QP_DECLARE_INDEX(r, data, arg)      \
-    int QP_INDEX_NAME(arg);
+    int QP_INDEX_NAME(arg);                 \
+    bool QP_MOVE_NAME(arg);
 
 #define QP_INDEX_NAME(arg)                  \
     BOOST_PP_SEQ_CAT((QP_ARG_NAME(arg)) (_idx))
 
+#define QP_MOVE_NAME(arg)                   \
+    BOOST_PP_SEQ_CAT((QP_ARG_NAME(arg)) (_move))
+
 
 
 #define QP_ARG_FLAG(arg)    BOOST_PP_TUPLE_ELEM(0, arg)
@@ -0,0 +1,236 @@
+#ifndef QUERYPLAN_ADMISSION__HPP__
+#define QUERYPLAN_ADMISSION__HPP__
+
+/*
+ * Admission control in front of planners: bounded per-class queues,
+ * per-class concurrency limits and strict or weighted priority.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace queryplan {
+
+struct AdmissionClass {
+    std::string name;
+    size_t queue_limit;     // queued requests beyond this are rejected
+    size_t concurrency;     // requests of this class running at once
+    unsigned weight;        // share of workers under weighted priority
+
+    AdmissionClass(const std::string& n, size_t q, size_t c,
+                   unsigned w = 1) :
+        name(n), queue_limit(q), concurrency(c), weight(w) {}
+};
+
+
+/*
+ * Front-end executor for planners: requests are queued per class and run
+ * by a fixed set of workers, honoring per-class concurrency limits.  With
+ * strict priority the first class with runnable requests always goes
+ * first; with weighted priority runnable classes share workers by weight
+ * (smooth weighted round robin).  A request whose class queue is full is
+ * rejected immediately.  Requests should catch their own exceptions,
+ * those escaping are only counted as failed.
+ */
+class AdmissionController {
+public:
+    enum class Priority {
+        Strict,
+        Weighted
+    };
+
+    // Completed requests include failed ones, which threw.
+    struct Stats {
+        size_t accepted;
+        size_t rejected;
+        size_t completed;
+        size_t failed;
+    };
+
+    AdmissionController(const std::vector<AdmissionClass>& classes,
+            size_t threads = std::thread::hardware_concurrency(),
+            Priority priority = Priority::Strict) :
+                policy(priority), stopping(false) {
+        for (auto& c : classes) {
+            queues.push_back(std::unique_ptr<Queue>(new Queue(c)));
+        }
+
+        if (threads == 0) {
+            threads = 1;
+        }
+
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&AdmissionController::work, this));
+        }
+    }
+
+    AdmissionController(const AdmissionController&) = delete;
+    AdmissionController& operator=(const AdmissionController&) = delete;
+
+    // Runs requests already admitted before the workers exit.
+    ~AdmissionController() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wakeup.notify_all();
+
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    size_t classIndex(const std::string& name) const {
+        for (size_t i = 0; i < queues.size(); ++i) {
+            if (queues[i]->settings.name == name) {
+                return i;
+            }
+        }
+
+        throw std::invalid_argument("admission class \"" + name +
+                "\" not found");
+    }
+
+    // Returns false without queueing when the class queue is full.
+    bool submit(size_t cls, std::function<void()> request) {
+        Queue& q = *queues.at(cls);
+
+        {
+            std::lock_guard<std::mutex> lock(m);
+
+            if (q.requests.size() >= q.settings.queue_limit) {
+                ++q.rejected;
+                return false;
+            }
+
+            q.requests.push_back(std::move(request));
+            ++q.accepted;
+        }
+        wakeup.notify_one();
+
+        return true;
+    }
+
+    Stats stats(size_t cls) const {
+        std::lock_guard<std::mutex> lock(m);
+
+        const Queue& q = *queues.at(cls);
+        Stats s = { q.accepted, q.rejected, q.completed, q.failed };
+
+        return s;
+    }
+
+private:
+    // Guarded by AdmissionController::m.
+    struct Queue {
+        AdmissionClass settings;
+        std::deque<std::function<void()>> requests;
+        size_t running;
+        long long current;      // weighted round robin state
+        size_t accepted;
+        size_t rejected;
+        size_t completed;
+        size_t failed;
+
+        Queue(const AdmissionClass& c) :
+            settings(c), running(0), current(0), accepted(0), rejected(0),
+            completed(0), failed(0) {}
+
+        bool runnable() const {
+            return ! requests.empty() && running < settings.concurrency;
+        }
+    };
+
+    // Picks the class to serve next, must hold "m".
+    Queue* pick() {
+        Queue* best = nullptr;
+
+        if (policy == Priority::Strict) {
+            for (auto& q : queues) {
+                if (q->runnable()) {
+                    return q.get();
+                }
+            }
+
+            return nullptr;
+        }
+
+        long long total = 0;
+        for (auto& q : queues) {
+            if (q->runnable()) {
+                q->current += q->settings.weight;
+                total += q->settings.weight;
+
+                if (! best || q->current > best->current) {
+                    best = q.get();
+                }
+            }
+        }
+
+        if (best) {
+            best->current -= total;
+        }
+
+        return best;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(m);
+
+        for (;;) {
+            Queue* q = pick();
+
+            if (! q) {
+                if (stopping) {
+                    return;
+                }
+
+                wakeup.wait(lock);
+                continue;
+            }
+
+            std::function<void()> request = std::move(q->requests.front());
+            q->requests.pop_front();
+            ++q->running;
+            lock.unlock();
+
+            bool failed = false;
+            try {
+                request();
+            } catch (...) {
+                failed = true;
+            }
+
+            lock.lock();
+            --q->running;
+            ++q->completed;
+            if (failed) {
+                ++q->failed;
+            }
+
+            // a slot of a class with a limit below the worker count freed
+            wakeup.notify_one();
+        }
+    }
+
+    Priority policy;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    bool stopping;
+    mutable std::mutex m;
+    std::condition_variable wakeup;
+};
+
+}   /* namespace queryplan */
+
+#endif  /* QUERYPLAN_ADMISSION__HPP__ */
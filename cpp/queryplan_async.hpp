@@ -0,0 +1,264 @@
+#ifndef QUERYPLAN_ASYNC__HPP__
+#define QUERYPLAN_ASYNC__HPP__
+
+/*
+ * Asynchronous query submission: planners run on their own threads and
+ * callers get futures or callbacks.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "queryplan.hpp"
+
+
+namespace queryplan {
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue, after Dmitry
+ * Vyukov's design.  Capacity is rounded up to a power of two.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : head(0), tail(0) {
+        size_t n = 2;
+        while (n < capacity) {
+            n *= 2;
+        }
+
+        mask = n - 1;
+        cells.reset(new Cell[n]);
+        for (size_t i = 0; i < n; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(T&& v) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed)) {
+                    cell.data = std::move(v);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& v) {
+        size_t pos = head.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed)) {
+                    v = std::move(cell.data);
+                    cell.sequence.store(pos + mask + 1,
+                            std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    // keep consumers and producers off each other's cache line
+    std::atomic<size_t> head;
+    char padding[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+};
+
+
+// A finished query: the context holding module outputs, and statuses.
+struct QueryResult {
+    ContextPtr context;
+    std::vector<ModuleStatus> statuses;
+
+    // Output "index" of the plan, see QueryPlan::outputIndex().  List it
+    // in BuildOptions::outputs, or its sole reader may have moved it out.
+    template<typename T>
+    const T& output(int index) const {
+        return boost::any_cast<const T&>(context->at(index));
+    }
+};
+
+class QueryRejected : public std::runtime_error {
+public:
+    QueryRejected() : std::runtime_error("query queue is full") {}
+};
+
+
+/*
+ * Runs queries of planner "P" on its own threads so callers don't block.
+ * Submitted queries reach the threads through a bounded lock-free queue,
+ * and a query that finds it full is rejected with QueryRejected.  Idle
+ * threads sleep on a condition variable that submitters signal only when
+ * some thread sleeps.  P needs run(ContextPtr, A...) like the planners
+ * above.
+ */
+template<typename P>
+class AsyncQueryPlanner {
+public:
+    // Called on a planner thread, with a null exception on success.
+    typedef std::function<void(QueryResult&&, std::exception_ptr)> Callback;
+
+    AsyncQueryPlanner(P& planner,
+            size_t threads = std::thread::hardware_concurrency(),
+            size_t capacity = 1024) :
+                planner(planner), tasks(capacity), sleeping(0),
+                stopping(false) {
+        if (threads == 0) {
+            threads = 1;
+        }
+
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&AsyncQueryPlanner::work, this));
+        }
+    }
+
+    AsyncQueryPlanner(const AsyncQueryPlanner&) = delete;
+    AsyncQueryPlanner& operator=(const AsyncQueryPlanner&) = delete;
+
+    // Finishes queued queries before the threads exit.
+    ~AsyncQueryPlanner() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wakeup.notify_all();
+
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    template<typename... A>
+    std::future<QueryResult> submit(A... a) {
+        auto promise = std::make_shared<std::promise<QueryResult>>();
+        auto future = promise->get_future();
+
+        auto done = [promise](QueryResult&& result, std::exception_ptr e) {
+            if (e) {
+                promise->set_exception(e);
+            } else {
+                promise->set_value(std::move(result));
+            }
+        };
+
+        if (! post(done, a...)) {
+            promise->set_exception(std::make_exception_ptr(QueryRejected()));
+        }
+
+        return future;
+    }
+
+    // Returns false without calling "done" if the queue is full.
+    template<typename... A>
+    bool post(Callback done, A... a) {
+        P& p = planner;
+        std::function<void()> task = [&p, done, a...] {
+            QueryResult result;
+            std::exception_ptr error;
+
+            try {
+                result.context = std::make_shared<Context>();
+                result.statuses = p.run(result.context, a...);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            done(std::move(result), error);
+        };
+
+        if (! tasks.tryPush(std::move(task))) {
+            return false;
+        }
+
+        // An RMW rather than a load: ordered against the increment in
+        // work(), either the sleeper sees this task or we see the sleeper.
+        if (sleeping.fetch_add(0) > 0) {
+            std::lock_guard<std::mutex> lock(m);
+            wakeup.notify_one();
+        }
+
+        return true;
+    }
+
+private:
+    void work() {
+        std::function<void()> task;
+
+        for (;;) {
+            if (tasks.tryPop(task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m);
+            ++sleeping;
+
+            while (! tasks.tryPop(task)) {
+                if (stopping) {
+                    --sleeping;
+                    return;
+                }
+                wakeup.wait(lock);
+            }
+
+            --sleeping;
+            lock.unlock();
+
+            task();
+            task = nullptr;
+        }
+    }
+
+    P& planner;
+    BoundedQueue<std::function<void()>> tasks;
+    std::atomic<size_t> sleeping;
+    bool stopping;
+    std::mutex m;
+    std::condition_variable wakeup;
+    std::vector<std::thread> workers;
+};
+
+}   /* namespace queryplan */
+
+#endif  /* QUERYPLAN_ASYNC__HPP__ */
@@ -0,0 +1,448 @@
+#ifndef QUERYPLAN_MULTITHREAD__HPP__
+#define QUERYPLAN_MULTITHREAD__HPP__
+
+/*
+ * A planner running modules of a query concurrently on a thread pool,
+ * and hedging slow idempotent ones.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <boost/graph/graph_traits.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "queryplan.hpp"
+
+
+namespace queryplan {
+
+// Runs tasks at given times on its own thread; meant for short tasks.
+class Timer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    Timer() : stopping(false), thread(&Timer::work, this) {}
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    // Tasks that aren't due yet are dropped.
+    ~Timer() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    void schedule(Clock::time_point when, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push(std::make_pair(when, std::move(task)));
+        }
+        wakeup.notify_one();
+    }
+
+private:
+    typedef std::pair<Clock::time_point, std::function<void()>> Task;
+
+    struct Later {
+        bool operator()(const Task& a, const Task& b) const {
+            return a.first > b.first;
+        }
+    };
+
+    void work() {
+        std::unique_lock<std::mutex> lock(m);
+
+        while (! stopping) {
+            if (tasks.empty()) {
+                wakeup.wait(lock);
+            } else if (tasks.top().first > Clock::now()) {
+                wakeup.wait_until(lock, tasks.top().first);
+            } else {
+                auto task = tasks.top().second;
+                tasks.pop();
+
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+    }
+
+    std::priority_queue<Task, std::vector<Task>, Later> tasks;
+    bool stopping;
+    std::mutex m;
+    std::condition_variable wakeup;
+    std::thread thread;
+};
+
+
+/*
+ * When to start a second invocation of an idempotent module: after a
+ * fixed delay, or after the given percentile of its recent latencies
+ * once enough of them were seen.
+ */
+class HedgePolicy {
+public:
+    HedgePolicy(long long after_us, double p) :
+            percentile(p), next(0), recorded(0), threshold(after_us),
+            launched_(0), won_(0) {
+        fixed = after_us >= 0;
+    }
+
+    // Microseconds to wait before hedging, negative while unknown.
+    long long thresholdMicroseconds() const {
+        return threshold;
+    }
+
+    // Second invocations started, and those that finished first.
+    size_t launched() const {
+        return launched_;
+    }
+
+    size_t won() const {
+        return won_;
+    }
+
+    void recordLaunch() {
+        ++launched_;
+    }
+
+    void recordWin() {
+        ++won_;
+    }
+
+    void record(long long us) {
+        if (fixed) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m);
+
+        if (latencies.size() < Window) {
+            latencies.push_back(us);
+        } else {
+            latencies[next] = us;
+        }
+        next = (next + 1) % Window;
+
+        if (++recorded % Refresh == 0 && latencies.size() >= MinSamples) {
+            std::vector<long long> sorted(latencies);
+            std::sort(sorted.begin(), sorted.end());
+
+            size_t rank = static_cast<size_t>(
+                    sorted.size() * percentile / 100 + 0.999999);
+            threshold = sorted[rank > 0 ? rank - 1 : 0];
+        }
+    }
+
+private:
+    static const size_t Window = 1024;
+    static const size_t Refresh = 16;
+    static const size_t MinSamples = 32;
+
+    bool fixed;
+    double percentile;
+    std::vector<long long> latencies;
+    size_t next;
+    size_t recorded;
+    std::atomic<long long> threshold;
+    std::atomic<size_t> launched_;
+    std::atomic<size_t> won_;
+    std::mutex m;
+};
+
+
+/*
+ * Runs each module on a thread pool as soon as its upstreams are done,
+ * the caller blocks until the whole plan has finished.  The first
+ * exception thrown by a module is rethrown to the caller after the rest
+ * of the plan ran.
+ *
+ * Modules marked "idempotent" in the plan are hedged: if one hasn't
+ * finished after "hedge_after_us" microseconds, or by default after the
+ * "hedge_percentile" (95) of its observed latency, a second invocation
+ * starts on another thread and whichever finishes first wins.  Both read
+ * their inputs in place and write outputs to a scratch context, moved
+ * into the query's by the winner, so their functors must be reentrant.
+ * The slower one may still run after the query returned, so it must not
+ * keep reference arguments of the planner, and callers of run() must not
+ * modify the inputs of hedged modules in the returned context.
+ */
+template<typename M, typename... C>
+class MultiThreadBlockedQueryPlanner :
+        public QueryPlannerBase<MultiThreadBlockedQueryPlanner<M, C...>>
+{
+public:
+    MultiThreadBlockedQueryPlanner(
+            const boost::property_tree::ptree& config, C... c) :
+                MultiThreadBlockedQueryPlanner(BuildOptions(), config, c...) {
+    }
+
+    MultiThreadBlockedQueryPlanner(const BuildOptions& options,
+            const boost::property_tree::ptree& config, C... c) :
+                MultiThreadBlockedQueryPlanner(
+                    QueryPlan<M, C...>(options, config, c...)) {
+    }
+
+    MultiThreadBlockedQueryPlanner(const QueryPlan<M, C...>& plan,
+            size_t threads = std::thread::hardware_concurrency()) :
+                plan(plan), pool(threads) {
+        auto& g = this->plan.dependencies();
+
+        for (size_t v = 0; v < boost::num_vertices(g); ++v) {
+            auto& settings = this->plan.settings(v);
+
+            if (settings.template get<bool>("idempotent", false)) {
+                hedges.push_back(std::make_shared<HedgePolicy>(
+                        settings.template get<long long>(
+                            "hedge_after_us", -1),
+                        settings.template get<double>(
+                            "hedge_percentile", 95)));
+            } else {
+                hedges.push_back(nullptr);
+            }
+        }
+    }
+
+    // Like operator(), leaving module outputs in "ctx", except inputs moved
+    // out by their sole reader, see BuildOptions::outputs.
+    template<typename... A>
+    std::vector<ModuleStatus> run(ContextPtr ctx, A... a) {
+        auto& g = plan.dependencies();
+        prepare(*ctx, plan.numOutputs());
+        auto query = std::make_shared<Query<A...>>(ctx,
+                boost::num_vertices(g), profiler != nullptr, a...);
+
+        for (size_t v = 0; v < boost::num_vertices(g); ++v) {
+            query->pending[v] = boost::in_degree(v, g);
+        }
+
+        if (query->remaining == 0) {
+            return query->statuses;
+        }
+
+        for (size_t v = 0; v < boost::num_vertices(g); ++v) {
+            if (boost::in_degree(v, g) == 0) {
+                pool.submit([this, query, v] { start(query, v); });
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(query->m);
+            query->done.wait(lock, [&query] {
+                    return query->remaining == 0;
+            });
+        }
+
+        if (profiler) {
+            profiler->record(query->samples);
+        }
+
+        if (query->error) {
+            std::rethrow_exception(query->error);
+        }
+
+        return query->statuses;
+    }
+
+    // The hedge policy of the module at vertex "v", null unless idempotent.
+    std::shared_ptr<const HedgePolicy> hedgePolicy(size_t v) const {
+        return hedges.at(v);
+    }
+
+private:
+    typedef QueryPlannerBase<MultiThreadBlockedQueryPlanner<M, C...>> Base;
+    typedef typename QueryPlan<M, C...>::Graph G;
+    typedef typename G::vertex_descriptor Vertex;
+
+    using Base::prepare;
+    using Base::profiler;
+
+    template<typename... A>
+    struct Query {
+        ContextPtr ctx;
+        std::vector<ModuleStatus> statuses;
+        std::vector<QueryProfiler::Sample> samples;
+        std::vector<std::atomic_int> pending;
+        std::atomic<size_t> remaining;
+        std::tuple<A...> args;
+        std::exception_ptr error;
+        std::mutex m;
+        std::condition_variable done;
+
+        Query(ContextPtr c, size_t num_modules, bool profiling, A... a) :
+            ctx(c),
+            statuses(num_modules, ModuleStatus::Skipped),
+            samples(profiling ? num_modules : 0),
+            pending(num_modules), remaining(num_modules), args(a...) {}
+
+        QueryProfiler::Sample* sample(Vertex v) {
+            return samples.empty() ? nullptr : &samples[v];
+        }
+
+        void fail(std::exception_ptr e) {
+            std::lock_guard<std::mutex> lock(m);
+            if (! error) {
+                error = e;
+            }
+        }
+    };
+
+    // Both invocations of a hedged module race to finish first.
+    struct Race {
+        std::atomic<bool> finished;
+
+        Race() : finished(false) {}
+    };
+
+    template<typename... A>
+    void start(std::shared_ptr<Query<A...>> query, Vertex v) {
+        auto& g = plan.dependencies();
+
+        for (auto u = boost::inv_adjacent_vertices(v, g);
+                u.first != u.second; ++u.first) {
+            if (query->statuses[*u.first] != ModuleStatus::Succeeded) {
+                finish(query, v, ModuleStatus::Skipped);
+                return;
+            }
+        }
+
+        if (hedges[v]) {
+            runHedged(query, v);
+            return;
+        }
+
+        ModuleStatus status;
+        try {
+            status = invoke(*g[v], query->ctx, *query->ctx, query->sample(v),
+                    query->args,
+                    typename MakeIndexes<sizeof...(A)>::type());
+        } catch (...) {
+            query->fail(std::current_exception());
+            status = ModuleStatus::Failed;
+        }
+
+        finish(query, v, status);
+    }
+
+    template<typename... A>
+    void runHedged(std::shared_ptr<Query<A...>> query, Vertex v) {
+        auto race = std::make_shared<Race>();
+        long long threshold = hedges[v]->thresholdMicroseconds();
+
+        if (threshold >= 0) {
+            timer.schedule(Timer::Clock::now() +
+                    std::chrono::microseconds(threshold),
+                    [this, query, v, race] {
+                        if (! race->finished) {
+                            hedges[v]->recordLaunch();
+                            pool.submit([this, query, v, race] {
+                                attempt(query, v, race, true);
+                            });
+                        }
+                    });
+        }
+
+        attempt(query, v, race, false);
+    }
+
+    template<typename... A>
+    void attempt(std::shared_ptr<Query<A...>> query, Vertex v,
+                 std::shared_ptr<Race> race, bool hedge) {
+        auto& g = plan.dependencies();
+        Context out(plan.numOutputs(), query->ctx);
+
+        QueryProfiler::Sample sample;
+        std::exception_ptr error;
+        ModuleStatus status;
+
+        auto t0 = std::chrono::steady_clock::now();
+        try {
+            status = invoke(*g[v], query->ctx, out,
+                    query->samples.empty() ? nullptr : &sample,
+                    query->args,
+                    typename MakeIndexes<sizeof...(A)>::type());
+        } catch (...) {
+            error = std::current_exception();
+            status = ModuleStatus::Failed;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        hedges[v]->record(std::chrono::duration_cast<
+                std::chrono::microseconds>(t1 - t0).count());
+
+        if (race->finished.exchange(true)) {
+            return;
+        }
+
+        if (hedge) {
+            hedges[v]->recordWin();
+        }
+
+        for (auto slot : plan.outputSlots(v)) {
+            (*query->ctx)[slot] = std::move(out[slot]);
+        }
+
+        if (query->sample(v)) {
+            *query->sample(v) = sample;
+        }
+
+        if (error) {
+            query->fail(error);
+        }
+
+        finish(query, v, status);
+    }
+
+    template<typename... A>
+    void finish(std::shared_ptr<Query<A...>> query, Vertex v,
+                ModuleStatus status) {
+        auto& g = plan.dependencies();
+        query->statuses[v] = status;
+
+        for (auto d = boost::adjacent_vertices(v, g);
+                d.first != d.second; ++d.first) {
+            Vertex next = *d.first;
+
+            if (--query->pending[next] == 0) {
+                pool.submit([this, query, next] { start(query, next); });
+            }
+        }
+
+        if (--query->remaining == 0) {
+            std::lock_guard<std::mutex> lock(query->m);
+            query->done.notify_all();
+        }
+    }
+
+    template<typename... A, size_t... I>
+    static ModuleStatus invoke(M& module, const ContextPtr& ctx, Context& out,
+                               QueryProfiler::Sample* sample,
+                               std::tuple<A...>& args, Indexes<I...>) {
+        return invokeModule(module, ctx, out, sample, std::get<I>(args)...);
+    }
+
+    // the pool is joined before hedge policies and plan are gone
+    QueryPlan<M, C...> plan;
+    std::vector<std::shared_ptr<HedgePolicy>> hedges;
+    ThreadPool pool;
+    Timer timer;
+};
+
+}   /* namespace queryplan */
+
+#endif  /* QUERYPLAN_MULTITHREAD__HPP__ */
@@ -0,0 +1,788 @@
+#ifndef QUERYPLAN_PROCESS__HPP__
+#define QUERYPLAN_PROCESS__HPP__
+
+/*
+ * Runs selected modules of a query plan in local worker processes, Linux
+ * only.  Plan entries marked "process" are replaced by proxies that copy
+ * the module inputs into a shared memory slot, queue the slot on a ring
+ * read by a forked worker and wait for the outputs written back into the
+ * same slot.  A worker that dies, or runs a call past its timeout, fails
+ * the modules it was running and is forked again from the planner process,
+ * which still holds the pristine module instances.  Workers are forked by
+ * one long-lived thread per worker and never take locks other threads of
+ * the planner may have held at fork time.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <boost/any.hpp>
+#include "queryplan.hpp"
+
+#ifndef QP_PROCESS_SLOTS
+#define QP_PROCESS_SLOTS            16
+#endif
+
+#ifndef QP_PROCESS_SLOT_SIZE
+#define QP_PROCESS_SLOT_SIZE        (64 * 1024)
+#endif
+
+
+namespace queryplan {
+
+/*
+ * How a value crosses the process boundary: trivially copyable types are
+ * copied byte for byte, strings as their characters.
+ */
+template<typename T>
+struct ShmValue {
+    static_assert(std::is_trivially_copyable<T>::value,
+            "only trivially copyable types and strings can be passed "
+            "to a worker process");
+
+    static size_t size(const T&) {
+        return sizeof(T);
+    }
+
+    static void write(const T& v, char* p) {
+        std::memcpy(p, &v, sizeof(T));
+    }
+
+    static T read(const char* p, size_t) {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+};
+
+template<typename Ch, typename Tr, typename A>
+struct ShmValue<std::basic_string<Ch, Tr, A>> {
+    typedef std::basic_string<Ch, Tr, A> T;
+
+    static size_t size(const T& s) {
+        return s.size() * sizeof(Ch);
+    }
+
+    static void write(const T& s, char* p) {
+        std::memcpy(p, s.data(), s.size() * sizeof(Ch));
+    }
+
+    // allocates from Arena::current() when A is ArenaAllocator
+    static T read(const char* p, size_t n) {
+        return T(reinterpret_cast<const Ch*>(p), n / sizeof(Ch));
+    }
+};
+
+
+/*
+ * Types that may be inputs or outputs of isolated modules.  Workers use a
+ * snapshot taken before they are forked, so codec ids mean the same in
+ * the planner and its workers.
+ */
+class ShmCodecs {
+public:
+    struct Codec {
+        size_t (*size)(const boost::any&);
+        void (*write)(const boost::any&, char*);
+        void (*read)(const char*, size_t, boost::any&);
+    };
+
+    struct Table {
+        std::map<std::type_index, int> ids;
+        std::vector<Codec> codecs;
+
+        int find(const std::type_info& type) const {
+            auto it = ids.find(std::type_index(type));
+            return it == ids.end() ? -1 : it->second;
+        }
+    };
+
+    template<typename T>
+    static void add() {
+        ShmCodecs& r = instance();
+        std::lock_guard<std::mutex> lock(r.m);
+        r.insert<T>();
+    }
+
+    static int find(const std::type_info& type) {
+        ShmCodecs& r = instance();
+        std::lock_guard<std::mutex> lock(r.m);
+
+        return r.table.find(type);
+    }
+
+    // The codecs registered so far, to be read without locking.
+    static Table snapshot() {
+        ShmCodecs& r = instance();
+        std::lock_guard<std::mutex> lock(r.m);
+
+        return r.table;
+    }
+
+private:
+    ShmCodecs() {
+        insert<bool>();
+        insert<char>();
+        insert<short>();
+        insert<unsigned short>();
+        insert<int>();
+        insert<unsigned>();
+        insert<long>();
+        insert<unsigned long>();
+        insert<long long>();
+        insert<unsigned long long>();
+        insert<float>();
+        insert<double>();
+        insert<std::string>();
+        insert<ArenaString>();
+    }
+
+    static ShmCodecs& instance() {
+        static ShmCodecs r;
+
+        return r;
+    }
+
+    template<typename T>
+    void insert() {
+        if (table.ids.count(std::type_index(typeid(T)))) {
+            return;
+        }
+
+        Codec c = { &sizeOf<T>, &writeTo<T>, &readFrom<T> };
+        table.ids[std::type_index(typeid(T))] = table.codecs.size();
+        table.codecs.push_back(c);
+    }
+
+    template<typename T>
+    static size_t sizeOf(const boost::any& v) {
+        return ShmValue<T>::size(boost::any_cast<const T&>(v));
+    }
+
+    template<typename T>
+    static void writeTo(const boost::any& v, char* p) {
+        ShmValue<T>::write(boost::any_cast<const T&>(v), p);
+    }
+
+    template<typename T>
+    static void readFrom(const char* p, size_t n, boost::any& v) {
+        v = ShmValue<T>::read(p, n);
+    }
+
+    Table table;
+    std::mutex m;
+};
+
+
+/*
+ * Serializes slot values as (slot, codec, length, bytes) records, each
+ * aligned to 8 bytes so trivially copyable values are copied aligned.
+ */
+class ShmMessage {
+public:
+    ShmMessage(char* data, size_t capacity, const ShmCodecs::Table& codecs) :
+        codecs(codecs), begin(data), p(data), end(data + capacity) {}
+
+    size_t size() const {
+        return p - begin;
+    }
+
+    void putInt(uint32_t v) {
+        char* q = reserve(sizeof(v));
+        std::memcpy(q, &v, sizeof(v));
+    }
+
+    uint32_t getInt() {
+        uint32_t v;
+        std::memcpy(&v, reserve(sizeof(v)), sizeof(v));
+        return v;
+    }
+
+    void putBytes(const char* s, size_t n) {
+        putInt(n);
+        std::memcpy(reserve(n), s, n);
+    }
+
+    std::string getBytes() {
+        size_t n = getInt();
+        return std::string(reserve(n), n);
+    }
+
+    void putValue(uint32_t slot, const boost::any& v) {
+        int id = codecs.find(v.type());
+        if (id < 0) {
+            throw std::invalid_argument(std::string("type ") +
+                    v.type().name() + " can't be passed to a worker process");
+        }
+
+        const ShmCodecs::Codec& codec = codecs.codecs.at(id);
+        size_t n = codec.size(v);
+
+        putInt(slot);
+        putInt(id);
+        putInt(n);
+        align();
+        codec.write(v, reserve(n));
+        align();
+    }
+
+    void getValue(Context& ctx) {
+        uint32_t slot = getInt();
+        const ShmCodecs::Codec& codec = codecs.codecs.at(getInt());
+        size_t n = getInt();
+
+        align();
+        codec.read(reserve(n), n, ctx.at(slot));
+        align();
+    }
+
+private:
+    char* reserve(size_t n) {
+        if (n > size_t(end - p)) {
+            throw std::length_error("worker process message exceeds "
+                    "QP_PROCESS_SLOT_SIZE");
+        }
+
+        char* q = p;
+        p += n;
+        return q;
+    }
+
+    void align() {
+        reserve((8 - size() % 8) % 8);
+    }
+
+    const ShmCodecs::Table& codecs;
+    char* begin;
+    char* p;
+    char* end;
+};
+
+
+inline void futexWait(std::atomic<uint32_t>& word, uint32_t expected,
+                      long nanoseconds) {
+    struct timespec timeout = { 0, nanoseconds };
+    syscall(SYS_futex, &word, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+inline void futexWake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+
+/*
+ * One worker process and the shared memory it serves.  Slots are owned by
+ * the planner until queued on the ring, then by the worker until their
+ * state leaves Requested.
+ */
+class ProcessWorker {
+public:
+    struct Job {
+        std::shared_ptr<Module<>> module;
+        std::vector<int> outputs;
+    };
+
+    ProcessWorker(const std::map<uint32_t, Job>& jobs, size_t contextSize) :
+            jobs(jobs), context_size(contextSize),
+            codecs(ShmCodecs::snapshot()), pid(-1), spawn_errno(0),
+            stopping(false) {
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "futex needs a plain 32 bit word");
+
+        void* p = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::system_category(), "mmap");
+        }
+        shared = new (p) Shared();
+
+        efd = eventfd(0, EFD_CLOEXEC);
+        if (efd < 0) {
+            int e = errno;
+            munmap(shared, sizeof(Shared));
+            throw std::system_error(e, std::system_category(), "eventfd");
+        }
+
+        for (uint32_t i = 0; i < QP_PROCESS_SLOTS; ++i) {
+            free_slots.push_back(i);
+        }
+
+        spawner = std::thread(&ProcessWorker::spawnLoop, this);
+
+        std::unique_lock<std::mutex> lock(m);
+        spawned.wait(lock, [this] { return pid > 0 || spawn_errno; });
+        if (pid < 0) {
+            int e = spawn_errno;
+            lock.unlock();
+            release();
+            throw std::system_error(e, std::system_category(), "fork");
+        }
+    }
+
+    ProcessWorker(const ProcessWorker&) = delete;
+    ProcessWorker& operator=(const ProcessWorker&) = delete;
+
+    ~ProcessWorker() {
+        release();
+    }
+
+    /*
+     * Runs the module of plan vertex "v" in the worker, reading inputs
+     * from "ctx" and writing outputs to "out".  Returns false if the
+     * module failed or the worker died, and throws what the module threw
+     * as std::runtime_error.  A worker still running the call after
+     * "timeout", unless zero, is killed with the calls it had.
+     */
+    bool call(uint32_t v, const std::vector<int>& inputs, const Context& ctx,
+              Context& out, std::chrono::milliseconds timeout) {
+        SlotGuard guard(*this);
+        Slot& slot = shared->slots[guard.index];
+
+        ShmMessage request(slot.data, sizeof(slot.data), codecs);
+        request.putInt(v);
+        request.putInt(inputs.size());
+        for (int i : inputs) {
+            request.putValue(i, ctx.at(i));
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if (! alive()) {
+                waitForWorker(lock);
+            }
+
+            slot.state.store(Requested, std::memory_order_relaxed);
+            uint32_t tail = shared->tail.load(std::memory_order_relaxed);
+            shared->ring[tail % QP_PROCESS_SLOTS] = guard.index;
+            shared->tail.store(tail + 1, std::memory_order_release);
+        }
+
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0) {
+            throw std::system_error(errno, std::system_category(), "write");
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        uint32_t state;
+        while ((state = slot.state.load(std::memory_order_acquire)) ==
+                Requested) {
+            futexWait(slot.state, Requested, 10 * 1000 * 1000);
+
+            std::lock_guard<std::mutex> lock(m);
+            if (slot.state.load(std::memory_order_acquire) == Requested &&
+                    alive() && timeout.count() > 0 &&
+                    std::chrono::steady_clock::now() >= deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+                reap();
+            }
+        }
+
+        if (state == Crashed) {
+            return false;
+        }
+
+        ShmMessage response(slot.data, sizeof(slot.data), codecs);
+        uint32_t status = response.getInt();
+        if (status == Error) {
+            throw std::runtime_error(response.getBytes());
+        }
+
+        Arena::Scope arena_scope(out.arena());
+        for (uint32_t n = response.getInt(); n > 0; --n) {
+            response.getValue(out);
+        }
+
+        return status == Succeeded;
+    }
+
+private:
+    enum : uint32_t {
+        Free,
+        Requested,
+        Done,
+        Crashed
+    };
+
+    enum : uint32_t {
+        Failed,
+        Succeeded,
+        Error
+    };
+
+    struct Slot {
+        std::atomic<uint32_t> state;
+        alignas(8) char data[QP_PROCESS_SLOT_SIZE];
+
+        Slot() : state(Free) {}
+    };
+
+    struct Shared {
+        std::atomic<uint32_t> head;     // next ring entry the worker reads
+        char padding[64 - sizeof(std::atomic<uint32_t>)];
+        std::atomic<uint32_t> tail;     // next ring entry the planner writes
+        uint32_t ring[QP_PROCESS_SLOTS];
+        Slot slots[QP_PROCESS_SLOTS];
+
+        Shared() : head(0), tail(0) {}
+    };
+
+    struct SlotGuard {
+        ProcessWorker& worker;
+        uint32_t index;
+
+        SlotGuard(ProcessWorker& w) : worker(w) {
+            std::unique_lock<std::mutex> lock(worker.slots_m);
+            while (worker.free_slots.empty()) {
+                worker.slot_freed.wait(lock);
+            }
+
+            index = worker.free_slots.back();
+            worker.free_slots.pop_back();
+        }
+
+        ~SlotGuard() {
+            worker.shared->slots[index].state.store(Free,
+                    std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> lock(worker.slots_m);
+            worker.free_slots.push_back(index);
+            worker.slot_freed.notify_one();
+        }
+    };
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        spawn_requested.notify_one();
+        spawner.join();
+
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+
+        close(efd);
+        shared->~Shared();
+        munmap(shared, sizeof(Shared));
+    }
+
+    // Reaps a dead worker, must hold "m".
+    bool alive() {
+        if (pid < 0) {
+            return false;
+        }
+
+        if (waitpid(pid, nullptr, WNOHANG) == 0) {
+            return true;
+        }
+
+        reap();
+        return false;
+    }
+
+    // Fails the slots of a reaped worker and asks for another, must hold "m".
+    void reap() {
+        pid = -1;
+        for (auto& slot : shared->slots) {
+            if (slot.state.load(std::memory_order_acquire) == Requested) {
+                slot.state.store(Crashed, std::memory_order_release);
+                futexWake(slot.state);
+            }
+        }
+
+        spawn_requested.notify_one();
+    }
+
+    // Waits for the spawner to fork a worker, must hold "m".
+    void waitForWorker(std::unique_lock<std::mutex>& lock) {
+        while (pid < 0) {
+            if (spawn_errno) {
+                int e = spawn_errno;
+                spawn_errno = 0;
+                spawn_requested.notify_one();
+                throw std::system_error(e, std::system_category(), "fork");
+            }
+
+            spawned.wait(lock);
+        }
+    }
+
+    /*
+     * Forks every worker from this one thread, so PR_SET_PDEATHSIG, which
+     * follows the forking thread, fires only when the ProcessWorker goes.
+     */
+    void spawnLoop() {
+        std::unique_lock<std::mutex> lock(m);
+
+        for (;;) {
+            spawn_requested.wait(lock, [this] {
+                return stopping || (pid < 0 && ! spawn_errno);
+            });
+            if (stopping) {
+                return;
+            }
+
+            spawn();
+            spawned.notify_all();
+        }
+    }
+
+    // Must hold "m".
+    void spawn() {
+        shared->head.store(0, std::memory_order_relaxed);
+        shared->tail.store(0, std::memory_order_relaxed);
+
+        // or the worker would print what the planner had buffered
+        std::fflush(nullptr);
+
+        // a stdio lock held by another thread would stay locked in the
+        // worker, so hold them across fork()
+        flockfile(stdout);
+        flockfile(stderr);
+
+        pid_t parent = getpid();
+        pid_t child = fork();
+        if (child == 0) {
+            funlockfile(stderr);
+            funlockfile(stdout);
+
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != parent) {
+                _exit(0);
+            }
+
+            serve();
+        }
+
+        int e = errno;
+        funlockfile(stderr);
+        funlockfile(stdout);
+
+        if (child < 0) {
+            spawn_errno = e;
+        } else {
+            pid = child;
+        }
+    }
+
+    // Worker process main loop, never returns.
+    void serve() {
+        for (;;) {
+            uint64_t n;
+            if (read(efd, &n, sizeof(n)) < 0 && errno != EINTR) {
+                _exit(1);
+            }
+
+            uint32_t head = shared->head.load(std::memory_order_relaxed);
+            while (head != shared->tail.load(std::memory_order_acquire)) {
+                Slot& slot = shared->slots[shared->ring[head %
+                    QP_PROCESS_SLOTS]];
+                shared->head.store(++head, std::memory_order_release);
+
+                handle(slot);
+                std::fflush(nullptr);
+
+                slot.state.store(Done, std::memory_order_release);
+                futexWake(slot.state);
+            }
+        }
+    }
+
+    void handle(Slot& slot) {
+        try {
+            ShmMessage request(slot.data, sizeof(slot.data), codecs);
+            const Job& job = jobs.at(request.getInt());
+            ContextPtr ctx = std::make_shared<Context>(context_size);
+
+            {
+                Arena::Scope arena_scope(ctx->arena());
+                for (uint32_t n = request.getInt(); n > 0; --n) {
+                    request.getValue(*ctx);
+                }
+            }
+
+            bool ok = (*job.module)(ctx);
+
+            // the inputs were copied out, so outputs may overwrite them
+            ShmMessage response(slot.data, sizeof(slot.data), codecs);
+            response.putInt(ok ? Succeeded : Failed);
+            response.putInt(ok ? job.outputs.size() : 0);
+            if (ok) {
+                for (int i : job.outputs) {
+                    response.putValue(i, ctx->at(i));
+                }
+            }
+        } catch (std::exception& e) {
+            ShmMessage response(slot.data, sizeof(slot.data), codecs);
+            response.putInt(Error);
+            response.putBytes(e.what(),
+                    std::min(std::strlen(e.what()), size_t(1024)));
+        } catch (...) {
+            ShmMessage response(slot.data, sizeof(slot.data), codecs);
+            response.putInt(Error);
+            response.putBytes("unknown exception", 17);
+        }
+    }
+
+    const std::map<uint32_t, Job> jobs;
+    const size_t context_size;
+    const ShmCodecs::Table codecs;      // read by the worker without locks
+    Shared* shared;
+    int efd;
+
+    std::mutex m;                       // guards the fields below and the
+    pid_t pid;                          // ring tail; -1 without a worker
+    int spawn_errno;                    // of the last failed fork()
+    bool stopping;
+    std::condition_variable spawn_requested;
+    std::condition_variable spawned;
+    std::thread spawner;
+
+    std::vector<uint32_t> free_slots;
+    std::mutex slots_m;
+    std::condition_variable slot_freed;
+};
+
+
+/*
+ * Stands in for an isolated module in the planner process.
+ */
+class ProcessModule : public Module<> {
+public:
+    ProcessModule(std::shared_ptr<Module<>> module, uint32_t vertex,
+                  const std::vector<int>& inputs,
+                  std::shared_ptr<ProcessWorker> worker,
+                  std::chrono::milliseconds timeout) :
+        module(module), vertex(vertex), inputs(inputs), worker(worker),
+        timeout(timeout) {}
+
+    using Module<>::resolve;
+
+    void resolve(const std::map<std::string, int>&,
+                 const std::set<std::string>&) {}
+
+    using Module<>::operator();
+
+    bool operator()(ContextPtr ctx, Context& out) {
+        return worker->call(vertex, inputs, *ctx, out, timeout);
+    }
+
+    const std::string& id() const {
+        return module->id();
+    }
+
+    void outputBytes(const Context& ctx, OutputBytes& bytes) const {
+        module->outputBytes(ctx, bytes);
+    }
+
+    bool outputsEqual(const Context& a, const Context& b) const {
+        return module->outputsEqual(a, b);
+    }
+
+private:
+    std::shared_ptr<Module<>> module;
+    const uint32_t vertex;
+    const std::vector<int> inputs;
+    std::shared_ptr<ProcessWorker> worker;
+    const std::chrono::milliseconds timeout;
+};
+
+
+/*
+ * Moves the modules of entries marked "process": true into "workers"
+ * worker processes, assigned round robin.  A call running longer than the
+ * entry's "process_timeout_ms", if set, fails and kills its worker along
+ * with the other calls it was running.  Call it before creating
+ * planners from "plan"; the workers exit when the last planner and the
+ * plan release the proxies.  Module inputs and outputs must be
+ * registered with ShmCodecs, and per call planner arguments can't cross
+ * the process boundary, so only Module<> plans are supported.
+ * Returns the number of isolated modules.
+ */
+template<typename... C>
+size_t isolateModules(QueryPlan<Module<>, C...>& plan, size_t workers = 1) {
+    auto& g = plan.dependencies();
+    std::vector<uint32_t> isolated;
+
+    for (uint32_t v = 0; v < boost::num_vertices(g); ++v) {
+        auto& entry = plan.settings(v);
+        if (! entry.get("process", false)) {
+            continue;
+        }
+
+        auto factory = getModuleFactoryRegistry<Module<>, C...>().find(
+                entry.template get<std::string>("module"));
+        for (auto& arg : factory->info()) {
+            if (ShmCodecs::find(arg.typeinfo()) < 0) {
+                throw std::invalid_argument("module \"" + g[v]->id() +
+                        "\" can't run in a worker process, its argument \"" +
+                        arg.name() + "\" has unregistered type " +
+                        arg.type());
+            }
+        }
+
+        isolated.push_back(v);
+    }
+
+    if (isolated.empty()) {
+        return 0;
+    }
+
+    std::vector<std::map<uint32_t, ProcessWorker::Job>> jobs(
+            std::max(size_t(1), std::min(workers, isolated.size())));
+    for (size_t i = 0; i < isolated.size(); ++i) {
+        uint32_t v = isolated[i];
+        ProcessWorker::Job job = { g[v], plan.outputSlots(v) };
+        jobs[i % jobs.size()][v] = job;
+    }
+
+    std::vector<std::shared_ptr<ProcessWorker>> processes;
+    for (auto& j : jobs) {
+        processes.push_back(std::make_shared<ProcessWorker>(j,
+                    plan.numOutputs()));
+    }
+
+    for (size_t i = 0; i < isolated.size(); ++i) {
+        uint32_t v = isolated[i];
+        g[v] = std::make_shared<ProcessModule>(g[v], v, plan.inputSlots(v),
+                processes[i % processes.size()],
+                std::chrono::milliseconds(plan.settings(v).get(
+                        "process_timeout_ms", 0)));
+    }
+
+    return isolated.size();
+}
+
+}   /* namespace queryplan */
+
+#endif  /* QUERYPLAN_PROCESS__HPP__ */
@@ -0,0 +1,363 @@
+#ifndef QUERYPLAN_REPLAY__HPP__
+#define QUERYPLAN_REPLAY__HPP__
+
+/*
+ * Captures planner arguments of live queries and replays them against a
+ * plan offline, see replay.cpp.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "queryplan.hpp"
+
+
+namespace queryplan {
+
+/*
+ * Text serialization of planner arguments for query captures.  Strings
+ * are length prefixed so they may contain separators, other types use
+ * their stream operators, floating point ones with enough digits to read
+ * back the same value.  Overload both functions for your own types.
+ */
+template<typename T>
+void writeArgument(std::ostream& out, const T& v) {
+    if (std::is_floating_point<T>::value) {
+        std::streamsize precision =
+            out.precision(std::numeric_limits<T>::max_digits10);
+        out << v;
+        out.precision(precision);
+    } else {
+        out << v;
+    }
+}
+
+inline void writeArgument(std::ostream& out, const std::string& s) {
+    out << s.size() << ':' << s;
+}
+
+template<typename T>
+void readArgument(std::istream& in, T& v) {
+    in >> v;
+}
+
+inline void readArgument(std::istream& in, std::string& s) {
+    size_t n;
+    char colon;
+
+    if (in >> n && in.get(colon) && colon == ':') {
+        s.resize(n);
+        in.read(&s[0], n);
+    } else {
+        in.setstate(std::ios::failbit);
+    }
+}
+
+
+/*
+ * Captures planner arguments of live queries, one line per query with
+ * microseconds since the epoch followed by the tab separated arguments.
+ */
+template<typename... A>
+class QueryRecorder {
+public:
+    QueryRecorder(std::ostream& o) : out(o) {}
+
+    void record(const A&... a) {
+        auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+
+        std::lock_guard<std::mutex> lock(m);
+
+        out << now;
+        int unused[] = { 0, (out << '\t', writeArgument(out, a), 0)... };
+        (void)unused;
+        out << '\n';
+    }
+
+private:
+    std::ostream& out;
+    std::mutex m;
+};
+
+
+// Records the arguments of every query before passing them on.
+template<typename P, typename... A>
+class RecordingQueryPlanner {
+public:
+    RecordingQueryPlanner(P& p, QueryRecorder<A...>& r) :
+        planner(p), recorder(r) {}
+
+    auto operator()(A... a) -> decltype(std::declval<P&>()(a...)) {
+        recorder.record(a...);
+        return planner(a...);
+    }
+
+private:
+    P& planner;
+    QueryRecorder<A...>& recorder;
+};
+
+
+struct ReplayOptions {
+    enum class Rate {
+        Original,       // keep captured gaps, divided by "speedup"
+        Fixed,          // "qps" queries per second
+        Maximum         // everything at once, open loop
+    };
+
+    Rate rate;
+    double speedup;
+    double qps;
+    size_t threads;
+
+    ReplayOptions() : rate(Rate::Original), speedup(1), qps(0),
+        threads(std::thread::hardware_concurrency()) {}
+};
+
+
+struct ReplayReport {
+    size_t queries;
+    double seconds;
+    std::vector<long long> latencies;   // sorted, in microseconds
+
+    double throughput() const {
+        return seconds > 0 ? queries / seconds : 0;
+    }
+
+    long long percentile(double p) const {
+        if (latencies.empty()) {
+            return 0;
+        }
+
+        size_t rank = static_cast<size_t>(latencies.size() * p / 100 + 0.999999);
+        return latencies[rank > 0 ? rank - 1 : 0];
+    }
+
+    void write(std::ostream& out) const {
+        out << "queries=" << queries << " seconds=" << seconds <<
+            " throughput=" << throughput() << "qps\n" <<
+            "latency(us): p50=" << percentile(50) <<
+            " p90=" << percentile(90) <<
+            " p99=" << percentile(99) <<
+            " p99.9=" << percentile(99.9) <<
+            " max=" << (latencies.empty() ? 0 : latencies.back()) << "\n";
+    }
+};
+
+
+/*
+ * Replays a query capture against a planner.  Queries are dispatched at
+ * their scheduled time no matter how many are still running, and latency
+ * is measured from that time, so queueing delay under overload counts.
+ */
+template<typename... A>
+class QueryReplayer {
+public:
+    typedef std::tuple<typename std::decay<A>::type...> Arguments;
+
+    QueryReplayer(std::istream& in) {
+        // strings may contain newlines, so lines are parsed as a stream
+        while (in.peek() != std::char_traits<char>::eof()) {
+            if (in.peek() == '#' || in.peek() == '\n') {
+                in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                continue;
+            }
+
+            long long timestamp;
+            Arguments args;
+
+            if (! (in >> timestamp) ||
+                    ! readArguments(in, args,
+                        typename MakeIndexes<sizeof...(A)>::type()) ||
+                    in.get() != '\n') {
+                throw std::invalid_argument("bad query capture at query " +
+                        std::to_string(queries.size() + 1));
+            }
+
+            queries.push_back(std::make_pair(timestamp, args));
+        }
+    }
+
+    size_t size() const {
+        return queries.size();
+    }
+
+    template<typename P>
+    ReplayReport replay(P& planner, const ReplayOptions& options) {
+        typedef std::chrono::steady_clock Clock;
+
+        ReplayReport report;
+        report.queries = queries.size();
+        report.latencies.resize(queries.size());
+
+        auto start = Clock::now();
+        {
+            ThreadPool pool(options.threads);
+
+            for (size_t i = 0; i < queries.size(); ++i) {
+                auto due = start + offset(i, options);
+                std::this_thread::sleep_until(due);
+
+                const Arguments& args = queries[i].second;
+                long long& latency = report.latencies[i];
+
+                pool.submit([&planner, &args, &latency, due] {
+                    call(planner, args,
+                        typename MakeIndexes<sizeof...(A)>::type());
+                    latency = std::chrono::duration_cast<
+                        std::chrono::microseconds>(Clock::now() - due).count();
+                });
+            }
+
+            pool.wait();
+        }
+
+        report.seconds = std::chrono::duration_cast<
+            std::chrono::duration<double>>(Clock::now() - start).count();
+        std::sort(report.latencies.begin(), report.latencies.end());
+
+        return report;
+    }
+
+private:
+    std::chrono::steady_clock::duration offset(
+            size_t i, const ReplayOptions& options) const {
+        double seconds = 0;
+
+        switch (options.rate) {
+        case ReplayOptions::Rate::Original:
+            seconds = (queries[i].first - queries[0].first) / 1e6 /
+                options.speedup;
+            break;
+        case ReplayOptions::Rate::Fixed:
+            seconds = i / options.qps;
+            break;
+        case ReplayOptions::Rate::Maximum:
+            break;
+        }
+
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(seconds));
+    }
+
+    template<size_t... I>
+    static bool readArguments(std::istream& in, Arguments& args,
+                              Indexes<I...>) {
+        int unused[] = { 0, (readField(in, std::get<I>(args)), 0)... };
+        (void)unused;
+
+        return ! in.fail();
+    }
+
+    template<typename T>
+    static void readField(std::istream& in, T& v) {
+        if (in.get() != '\t') {
+            in.setstate(std::ios::failbit);
+        }
+        readArgument(in, v);
+    }
+
+    template<typename P, size_t... I>
+    static void call(P& planner, const Arguments& args, Indexes<I...>) {
+        planner(std::get<I>(args)...);
+    }
+
+    std::vector<std::pair<long long, Arguments>> queries;
+};
+
+
+/*
+ * Replays a capture of queries with arguments A... against a plan built
+ * by the planner named "planner", "single" or "signal".
+ */
+template<typename... A>
+ReplayReport replayPlan(const boost::property_tree::ptree& plan,
+                        const std::string& planner, std::istream& capture,
+                        const ReplayOptions& options) {
+    QueryReplayer<A...> replayer(capture);
+
+    if (planner == "single") {
+        SingleThreadBlockedQueryPlanner<Module<A...>> p(plan);
+        return replayer.replay(p, options);
+    } else if (planner == "signal") {
+        SignalBasedSingleThreadBlockedQueryPlanner<Module<A...>> p(plan);
+        return replayer.replay(p, options);
+    }
+
+    throw std::invalid_argument("planner \"" + planner + "\" not found");
+}
+
+typedef std::function<ReplayReport(const boost::property_tree::ptree&,
+        const std::string&, std::istream&, const ReplayOptions&)> ReplayEntry;
+
+
+/*
+ * Replay entry points by the name of their planner argument list, so the
+ * replay tool can replay plans of modules it wasn't built with.
+ */
+class ReplayRegistry {
+public:
+    const ReplayEntry& find(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(m);
+
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            throw std::invalid_argument("replay \"" + name + "\" not found");
+        }
+
+        return it->second;
+    }
+
+    void insert(const std::string& name, const ReplayEntry& entry) {
+        std::lock_guard<std::mutex> lock(m);
+
+        if (! entries.insert(std::make_pair(name, entry)).second) {
+            throw std::runtime_error("replay \"" + name +
+                    "\" is already registered");
+        }
+    }
+
+private:
+    std::map<std::string, ReplayEntry> entries;
+    mutable std::mutex m;
+};
+
+inline ReplayRegistry& getReplayRegistry() {
+    static ReplayRegistry registry;
+
+    return registry;
+}
+
+class ReplayRegister {
+public:
+    ReplayRegister(const std::string& name, const ReplayEntry& entry) {
+        getReplayRegistry().insert(name, entry);
+    }
+};
+
+}   /* namespace queryplan */
+
+
+// Lets the replay tool replay plans whose planners take arguments of the
+// given types, under "name".  Use it at global scope, once per name.
+#define QP_REGISTER_REPLAY(name, ...)                       \
+    static queryplan::ReplayRegister                        \
+        BOOST_PP_CAT(theReplayRegisterInstance, __LINE__)(  \
+            name, &queryplan::replayPlan<__VA_ARGS__>)
+
+#endif  /* QUERYPLAN_REPLAY__HPP__ */
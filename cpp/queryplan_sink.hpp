@@ -0,0 +1,412 @@
+#ifndef QUERYPLAN_SINK__HPP__
+#define QUERYPLAN_SINK__HPP__
+
+/*
+ * Batched output for sink modules, POSIX only.  A sink module appends
+ * serialized records to a buffer owned by the calling thread and returns
+ * without touching the file; a background thread collects all buffers
+ * every flush interval, or earlier once enough bytes are pending, and
+ * writes them out with one writev() per batch.  Records from one thread
+ * keep their order, records from different threads interleave whole.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX                     1024
+#endif
+
+
+namespace queryplan {
+
+class BatchSink {
+public:
+    // What append() does when "max_buffered" bytes are already pending.
+    enum class Overflow { Block, Drop };
+
+    struct Options {
+        Options() : flush_interval(std::chrono::milliseconds(100)),
+                    batch_bytes(64 * 1024), max_buffered(4 << 20),
+                    overflow(Overflow::Block) {}
+
+        std::chrono::milliseconds flush_interval;
+        size_t batch_bytes;     // a thread buffer this full wakes the writer
+        size_t max_buffered;    // pending bytes over all thread buffers
+        Overflow overflow;
+    };
+
+    struct Stats {
+        uint64_t records;
+        uint64_t bytes;
+        uint64_t batches;       // writev() calls
+        uint64_t dropped;
+        uint64_t errors;
+    };
+
+    // Writes to "fd", which is closed with the sink if "own_fd".
+    BatchSink(int fd, bool own_fd = false, Options options = Options()) :
+            fd(fd), own_fd(own_fd), options(options), id(nextId()),
+            buffered(0), urgent(false), stopping(false),
+            flush_requested(0), flushed(0) {
+        zero(counters);
+        {
+            Live& l = live();
+            std::lock_guard<std::mutex> lock(l.m);
+            l.ids.insert(id);
+        }
+        writer = std::thread(&BatchSink::run, this);
+    }
+
+    // Appends to the file at "path", creating it if needed.
+    static std::shared_ptr<BatchSink> open(const std::string& path,
+            Options options = Options()) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                    "can't open sink " + path);
+        }
+
+        return std::make_shared<BatchSink>(fd, true, options);
+    }
+
+    BatchSink(const BatchSink&) = delete;
+    BatchSink& operator=(const BatchSink&) = delete;
+
+    // Writes everything appended so far before returning.
+    ~BatchSink() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        writer.join();
+
+        {
+            Live& l = live();
+            std::lock_guard<std::mutex> lock(l.m);
+            l.ids.erase(id);
+        }
+
+        if (own_fd) {
+            ::close(fd);
+        }
+    }
+
+    // Appends one record; false if dropped by Overflow::Drop.
+    bool append(const char* data, size_t size) {
+        if (! reserve(size)) {
+            ++counters.dropped;
+            return false;
+        }
+
+        Buffer& b = local();
+        size_t pending;
+        {
+            std::lock_guard<std::mutex> lock(b.m);
+            b.data.append(data, size);
+            pending = b.data.size();
+        }
+        ++counters.records;
+
+        if (pending >= options.batch_bytes && ! urgent.exchange(true)) {
+            std::lock_guard<std::mutex> lock(m);
+            wakeup.notify_one();
+        }
+
+        return true;
+    }
+
+    bool append(const std::string& record) {
+        return append(record.data(), record.size());
+    }
+
+    // Blocks until records appended before the call are written.
+    void flush() {
+        std::unique_lock<std::mutex> lock(m);
+        uint64_t generation = ++flush_requested;
+        wakeup.notify_one();
+        done.wait(lock, [&] { return flushed >= generation; });
+    }
+
+    size_t pending() const {
+        return buffered.load();
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.records = counters.records;
+        s.bytes = counters.bytes;
+        s.batches = counters.batches;
+        s.dropped = counters.dropped;
+        s.errors = counters.errors;
+        return s;
+    }
+
+private:
+    // "data" is appended to by its thread, "spare" is written out by the
+    // writer; swapping them keeps both allocations around.
+    struct Buffer {
+        std::mutex m;
+        std::string data;
+        std::string spare;
+    };
+
+    struct Counters {
+        std::atomic<uint64_t> records;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> batches;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> errors;
+    };
+
+    static void zero(Counters& c) {
+        c.records = 0;
+        c.bytes = 0;
+        c.batches = 0;
+        c.dropped = 0;
+        c.errors = 0;
+    }
+
+    // Sinks are told apart by id rather than address in the thread local
+    // cache below, a new sink may reuse the address of a destroyed one.
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> id(0);
+
+        return ++id;
+    }
+
+    // Ids of the sinks not yet destroyed.  Never freed, sinks held by
+    // static objects such as the registry below outlive any static here.
+    struct Live {
+        std::mutex m;
+        std::set<uint64_t> ids;
+    };
+
+    static Live& live() {
+        static Live* l = new Live;
+
+        return *l;
+    }
+
+    Buffer& local() {
+        struct Entry {
+            uint64_t id;
+            Buffer* buffer;
+        };
+        static thread_local std::vector<Entry> cache;
+
+        for (auto& e : cache) {
+            if (e.id == id) {
+                return *e.buffer;
+            }
+        }
+
+        // first append of this thread to this sink, forget destroyed sinks
+        // so threads outliving many sinks don't keep growing the cache
+        {
+            Live& l = live();
+            std::lock_guard<std::mutex> lock(l.m);
+            cache.erase(std::remove_if(cache.begin(), cache.end(),
+                        [&l](const Entry& e) { return ! l.ids.count(e.id); }),
+                    cache.end());
+        }
+
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffers.emplace_back(new Buffer);
+        cache.push_back(Entry{id, buffers.back().get()});
+        return *buffers.back();
+    }
+
+    // A record larger than "max_buffered" still goes through once
+    // nothing else is pending.
+    bool reserve(size_t size) {
+        size_t current = buffered.load();
+
+        for (;;) {
+            if (current == 0 || current + size <= options.max_buffered) {
+                if (buffered.compare_exchange_weak(current, current + size)) {
+                    return true;
+                }
+                continue;
+            }
+
+            if (options.overflow == Overflow::Drop) {
+                return false;
+            }
+
+            std::unique_lock<std::mutex> lock(m);
+            urgent = true;
+            wakeup.notify_one();
+            done.wait(lock, [&] {
+                size_t n = buffered.load();
+                return n == 0 || n + size <= options.max_buffered || stopping;
+            });
+            current = buffered.load();
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+
+        for (;;) {
+            wakeup.wait_for(lock, options.flush_interval, [&] {
+                return urgent || stopping || flush_requested > flushed;
+            });
+
+            bool last = stopping;
+            uint64_t generation = flush_requested;
+            urgent = false;
+
+            lock.unlock();
+            drain();
+            lock.lock();
+
+            flushed = generation;
+            done.notify_all();
+
+            if (last) {
+                break;
+            }
+        }
+    }
+
+    void drain() {
+        std::vector<Buffer*> batch;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            for (auto& b : buffers) {
+                std::lock_guard<std::mutex> buffer_lock(b->m);
+                if (! b->data.empty()) {
+                    b->data.swap(b->spare);
+                    batch.push_back(b.get());
+                }
+            }
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < batch.size(); i += IOV_MAX) {
+            std::vector<iovec> iov;
+            for (size_t j = i; j < batch.size() && j < i + IOV_MAX; ++j) {
+                auto& data = batch[j]->spare;
+                iov.push_back(iovec{&data[0], data.size()});
+                total += data.size();
+            }
+            write(iov);
+        }
+
+        for (auto b : batch) {
+            b->spare.clear();
+        }
+
+        buffered -= total;
+    }
+
+    // Writes all of "iov", resuming after short writes.
+    void write(std::vector<iovec>& iov) {
+        size_t first = 0;
+
+        while (first < iov.size()) {
+            ssize_t n = ::writev(fd, &iov[first], iov.size() - first);
+            ++counters.batches;
+
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ++counters.errors;
+                return;
+            }
+
+            counters.bytes += n;
+            while (first < iov.size() && size_t(n) >= iov[first].iov_len) {
+                n -= iov[first].iov_len;
+                ++first;
+            }
+            if (n > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                iov[first].iov_len -= n;
+            }
+        }
+    }
+
+    int fd;
+    bool own_fd;
+    Options options;
+    uint64_t id;
+
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::atomic<size_t> buffered;
+    Counters counters;
+
+    std::mutex m;
+    std::condition_variable wakeup;     // to the writer
+    std::condition_variable done;       // from the writer
+    std::atomic<bool> urgent;
+    bool stopping;
+    uint64_t flush_requested;
+    uint64_t flushed;
+    std::thread writer;
+};
+
+typedef std::shared_ptr<BatchSink> BatchSinkPtr;
+
+
+/*
+ * Sinks by name, so sink modules can find theirs when constructed.
+ */
+class SinkRegistry {
+public:
+    void add(const std::string& name, BatchSinkPtr sink) {
+        std::lock_guard<std::mutex> lock(m);
+        sinks[name] = sink;
+    }
+
+    void remove(const std::string& name) {
+        std::lock_guard<std::mutex> lock(m);
+        sinks.erase(name);
+    }
+
+    BatchSinkPtr find(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = sinks.find(name);
+        if (it == sinks.end()) {
+            throw std::invalid_argument("no sink named " + name);
+        }
+
+        return it->second;
+    }
+
+private:
+    mutable std::mutex m;
+    std::map<std::string, BatchSinkPtr> sinks;
+};
+
+inline SinkRegistry& getSinkRegistry() {
+    static SinkRegistry registry;
+
+    return registry;
+}
+
+}   /* namespace queryplan */
+
+#endif  /* QUERYPLAN_SINK__HPP__ */
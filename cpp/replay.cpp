@@ -0,0 +1,109 @@
+/*
+ * Replays a query capture against a query plan:
+ *
+ *   replay [-p single|signal] [-r original|max|QPS] [-s SPEEDUP]
+ *          [-t THREADS] [-m MODULE.so]... [-a ARGUMENTS]
+ *          plan.json capture.txt
+ *
+ * Modules are the examples in modules.hpp plus those registered by
+ * shared libraries given with "-m".  "-a" names the planner argument
+ * list of the plan as registered with QP_REGISTER_REPLAY(), such as
+ * "int,int" for the examples; it defaults to "none", for plans whose
+ * capture lines carry timestamps only.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <boost/property_tree/json_parser.hpp>
+#include "modules.hpp"
+#include "queryplan.hpp"
+#include "queryplan_replay.hpp"
+
+using namespace std;
+using namespace boost::property_tree;
+
+QP_REGISTER_REPLAY("none");
+
+static void usage(const char* prog)
+{
+    cerr << "Usage: " << prog << " [-p single|signal] [-r original|max|QPS]"
+        " [-s SPEEDUP]\n        [-t THREADS] [-m MODULE.so]..."
+        " [-a ARGUMENTS]\n        plan.json capture.txt\n";
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    queryplan::ReplayOptions options;
+    string planner = "single";
+    string arguments = "none";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:s:t:m:a:")) != -1) {
+        switch (opt) {
+        case 'p':
+            planner = optarg;
+            break;
+        case 'r':
+            if (string(optarg) == "original") {
+                options.rate = queryplan::ReplayOptions::Rate::Original;
+            } else if (string(optarg) == "max") {
+                options.rate = queryplan::ReplayOptions::Rate::Maximum;
+            } else {
+                options.rate = queryplan::ReplayOptions::Rate::Fixed;
+                options.qps = atof(optarg);
+                if (options.qps <= 0) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        case 's':
+            options.speedup = atof(optarg);
+            if (options.speedup <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'm':
+            if (! dlopen(optarg, RTLD_NOW | RTLD_GLOBAL)) {
+                cerr << dlerror() << "\n";
+                return 1;
+            }
+            break;
+        case 'a':
+            arguments = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+
+    try {
+        ptree pt;
+        read_json(argv[optind], pt);
+
+        ifstream in(argv[optind + 1]);
+        if (! in) {
+            throw runtime_error(string("can't open ") + argv[optind + 1]);
+        }
+
+        auto& replay = queryplan::getReplayRegistry().find(arguments);
+        replay(pt, planner, in, options).write(cout);
+    } catch (std::exception& e) {
+        cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}